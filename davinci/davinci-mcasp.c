@@ -28,6 +28,10 @@
 #include <linux/of_device.h>
 #include <linux/platform_data/davinci_asp.h>
 #include <linux/math64.h>
+#include <linux/regmap.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
 
 #include <sound/asoundef.h>
 #include <sound/core.h>
@@ -43,29 +47,100 @@
 
 #define MCASP_MAX_AFIFO_DEPTH	64
 
-static u32 context_regs[] = {
-	DAVINCI_MCASP_TXFMCTL_REG,
-	DAVINCI_MCASP_RXFMCTL_REG,
-	DAVINCI_MCASP_TXFMT_REG,
-	DAVINCI_MCASP_RXFMT_REG,
-	DAVINCI_MCASP_ACLKXCTL_REG,
-	DAVINCI_MCASP_ACLKRCTL_REG,
-	DAVINCI_MCASP_AHCLKXCTL_REG,
-	DAVINCI_MCASP_AHCLKRCTL_REG,
-	DAVINCI_MCASP_PDIR_REG,
-	DAVINCI_MCASP_RXMASK_REG,
-	DAVINCI_MCASP_TXMASK_REG,
-	DAVINCI_MCASP_RXTDM_REG,
-	DAVINCI_MCASP_TXTDM_REG,
+/* Upper bound for the DMA to serve the first TX event after TXSERCLR */
+#define MCASP_XRDATA_TIMEOUT_US	1000
+
+/* Number of XRUN events kept for debugfs, must be a power of two */
+#define MCASP_XRUN_LOG_SIZE	32
+
+/* Clock check sampling period and settle time of a one-shot measurement */
+#define MCASP_CLKCHK_INTERVAL_MS	100
+#define MCASP_CLKCHK_SETTLE_US		25
+
+static bool xrun_controls;
+module_param(xrun_controls, bool, 0444);
+MODULE_PARM_DESC(xrun_controls, "Export the XRUN counters as ALSA controls");
+
+static bool clkchk_strict;
+module_param(clkchk_strict, bool, 0644);
+MODULE_PARM_DESC(clkchk_strict,
+		 "Refuse hw_params not matching the measured external clock");
+
+/* AFIFO depth selection for a stream */
+enum {
+	MCASP_AFIFO_POLICY_DT = 0,	/* depth from tx-num-evt/rx-num-evt */
+	MCASP_AFIFO_POLICY_LATENCY,	/* shallowest possible depth */
+	MCASP_AFIFO_POLICY_THROUGHPUT,	/* deepest depth, fewest DMA events */
+};
+
+static const char * const davinci_mcasp_afifo_policies[] = {
+	[MCASP_AFIFO_POLICY_DT] = "dt",
+	[MCASP_AFIFO_POLICY_LATENCY] = "latency",
+	[MCASP_AFIFO_POLICY_THROUGHPUT] = "throughput",
 };
 
 struct davinci_mcasp_context {
-	u32	config_regs[ARRAY_SIZE(context_regs)];
-	u32	afifo_regs[2]; /* for read/write fifo control registers */
-	u32	*xrsr_regs; /* for serializer configuration */
 	bool	pm_state;
 };
 
+/* Configuration of the last successful hw_params of a stream */
+struct davinci_mcasp_stream_state {
+	bool	valid;
+	bool	dsd;
+	unsigned int dai_fmt;
+	int	channels;
+};
+
+enum {
+	MCASP_HW_PARAMS_FULL = 0,
+	MCASP_HW_PARAMS_DSD_SWITCH,
+	MCASP_HW_PARAMS_NUM,
+};
+
+struct davinci_mcasp_hw_stats {
+	unsigned int count;
+	u64	last_ns;
+	u64	max_ns;
+};
+
+struct davinci_mcasp_tx_start_stats {
+	unsigned int count;
+	unsigned int timeouts;
+	u64	min_ns;
+	u64	max_ns;
+	u64	total_ns;
+};
+
+enum {
+	MCASP_XRUN_FIFO = 0,	/* XUNDRN for playback, ROVRN for capture */
+	MCASP_XRUN_XRERR,
+	MCASP_XRUN_UNHANDLED,
+	MCASP_XRUN_NUM,
+};
+
+struct davinci_mcasp_xrun_event {
+	unsigned int seq;	/* written last, 0 for an unused slot */
+	ktime_t	time;
+	int	stream;
+	u32	stat;
+	u32	fifo_level;
+	snd_pcm_uframes_t position;
+	snd_pcm_uframes_t buffer_size;
+	unsigned int rate;
+	snd_pcm_format_t format;
+	unsigned int channels;
+};
+
+/* Clock check of the high-frequency clock (AHCLKX/AHCLKR) of a direction */
+struct davinci_mcasp_clkchk {
+	u8	count;		/* last XCNT/RCNT, 0 before the first sample */
+	u32	freq;		/* measured clock in Hz, 0 if lost */
+	unsigned int samples;
+	unsigned int loss;	/* clock stopped, the count did not move */
+	unsigned int change;	/* clock moved out of the count window */
+	unsigned int mismatch;	/* hw_params not matching the clock */
+};
+
 struct davinci_mcasp_ruledata {
 	struct davinci_mcasp *mcasp;
 	int serializers;
@@ -74,6 +149,7 @@ struct davinci_mcasp_ruledata {
 struct davinci_mcasp {
 	struct snd_dmaengine_dai_dma_data dma_data[2];
 	void __iomem *base;
+	struct regmap *regmap;
 	u32 fifo_base;
 	struct device *dev;
 	struct snd_pcm_substream *substreams[2];
@@ -89,17 +165,47 @@ struct davinci_mcasp {
 	u8	version;
 	u8	bclk_div;
 	bool	right_justified;
+
+	/*
+	 * streams, channels and substreams are shared by the playback and
+	 * the capture stream, which may belong to different DAI links
+	 */
+	spinlock_t lock;
 	int	streams;
 	u32	irq_request[2];
 	int	dma_request[2];
 	bool	dsd_mode[2];
+	struct davinci_mcasp_stream_state stream_state[2];
+	struct davinci_mcasp_hw_stats hw_stats[MCASP_HW_PARAMS_NUM];
+	struct davinci_mcasp_tx_start_stats tx_start_stats;
+
+	/* XRUN telemetry, updated from the IRQ threads without locking */
+	atomic_t xrun_count[2][MCASP_XRUN_NUM];
+	atomic_t xrun_seq;
+	struct davinci_mcasp_xrun_event xrun_log[MCASP_XRUN_LOG_SIZE];
 
 	int	sysclk_freq;
 	bool	bclk_master;
 
+	/* under lock: set_sysclk calls in progress, loopback test running */
+	int	sysclk_changes;
+	bool	loopback_running;
+
+	/* clock check, disabled without the functional clock rate */
+	unsigned long fclk_rate;
+	struct davinci_mcasp_clkchk clkchk[2];
+	struct delayed_work clkchk_work;
+
+	/* RX clocked from AHCLKR independently of TX (TX_ASYNC) */
+	bool	rx_async;
+	int	rx_sysclk_freq;
+
 	/* McASP FIFO related */
 	u8	txnumevt;
 	u8	rxnumevt;
+	u8	afifo_policy[2];
+	int	afifo_numevt[2];	/* NUMEVT of the last hw_params */
+	int	active_serializers[2];
 
 	bool	dat_port;
 
@@ -110,7 +216,13 @@ struct davinci_mcasp {
 	struct davinci_mcasp_context context;
 #endif
 
+#ifdef CONFIG_DEBUG_FS
+	struct dentry *debugfs_root;
+#endif
+
 	struct davinci_mcasp_ruledata ruledata[2];
+	/* feasible rates (bits of davinci_mcasp_dai_rates) per slot width */
+	u32	rate_mask[33];
 	struct snd_pcm_hw_constraint_list chconstr[2];
 
 	u32 autogpio_mask;
@@ -121,36 +233,160 @@ struct davinci_mcasp {
 static int davinci_mcasp_mute_stream(struct snd_soc_dai *cpu_dai,
 				   int mute, int stream);
 
+static bool davinci_mcasp_readable_reg(struct device *dev, unsigned int reg)
+{
+	struct davinci_mcasp *mcasp = dev_get_drvdata(dev);
+
+	switch (reg) {
+	case DAVINCI_MCASP_PID_REG:
+	case DAVINCI_MCASP_PWREMUMGT_REG:
+	case DAVINCI_MCASP_PFUNC_REG:
+	case DAVINCI_MCASP_PDIR_REG:
+	case DAVINCI_MCASP_PDOUT_REG:
+	case DAVINCI_MCASP_PDSET_REG:
+	case DAVINCI_MCASP_PDCLR_REG:
+	case DAVINCI_MCASP_GBLCTL_REG:
+	case DAVINCI_MCASP_AMUTE_REG:
+	case DAVINCI_MCASP_LBCTL_REG:
+	case DAVINCI_MCASP_TXDITCTL_REG:
+	case DAVINCI_MCASP_GBLCTLR_REG:
+	case DAVINCI_MCASP_RXMASK_REG:
+	case DAVINCI_MCASP_RXFMT_REG:
+	case DAVINCI_MCASP_RXFMCTL_REG:
+	case DAVINCI_MCASP_ACLKRCTL_REG:
+	case DAVINCI_MCASP_AHCLKRCTL_REG:
+	case DAVINCI_MCASP_RXTDM_REG:
+	case DAVINCI_MCASP_EVTCTLR_REG:
+	case DAVINCI_MCASP_RXSTAT_REG:
+	case DAVINCI_MCASP_RXTDMSLOT_REG:
+	case DAVINCI_MCASP_RXCLKCHK_REG:
+	case DAVINCI_MCASP_REVTCTL_REG:
+	case DAVINCI_MCASP_GBLCTLX_REG:
+	case DAVINCI_MCASP_TXMASK_REG:
+	case DAVINCI_MCASP_TXFMT_REG:
+	case DAVINCI_MCASP_TXFMCTL_REG:
+	case DAVINCI_MCASP_ACLKXCTL_REG:
+	case DAVINCI_MCASP_AHCLKXCTL_REG:
+	case DAVINCI_MCASP_TXTDM_REG:
+	case DAVINCI_MCASP_EVTCTLX_REG:
+	case DAVINCI_MCASP_TXSTAT_REG:
+	case DAVINCI_MCASP_TXTDMSLOT_REG:
+	case DAVINCI_MCASP_TXCLKCHK_REG:
+	case DAVINCI_MCASP_XEVTCTL_REG:
+		return true;
+	}
+
+	/* DIT channel status and user data register files */
+	if (reg >= DAVINCI_MCASP_DITCSRA_REG &&
+	    reg < DAVINCI_MCASP_XRSRCTL_BASE_REG)
+		return true;
+
+	if (reg >= DAVINCI_MCASP_XRSRCTL_BASE_REG &&
+	    reg < DAVINCI_MCASP_XRSRCTL_REG(mcasp->num_serializer))
+		return true;
+
+	if (reg >= mcasp->fifo_base &&
+	    reg <= mcasp->fifo_base + MCASP_RFIFOSTS_OFFSET)
+		return true;
+
+	return false;
+}
+
+static bool davinci_mcasp_writeable_reg(struct device *dev, unsigned int reg)
+{
+	struct davinci_mcasp *mcasp = dev_get_drvdata(dev);
+
+	switch (reg) {
+	case DAVINCI_MCASP_PID_REG:
+	case DAVINCI_MCASP_RXTDMSLOT_REG:
+	case DAVINCI_MCASP_TXTDMSLOT_REG:
+		return false;
+	}
+
+	if (reg == mcasp->fifo_base + MCASP_WFIFOSTS_OFFSET ||
+	    reg == mcasp->fifo_base + MCASP_RFIFOSTS_OFFSET)
+		return false;
+
+	return davinci_mcasp_readable_reg(dev, reg);
+}
+
+/* Registers which are changed by the hardware or have side effects */
+static bool davinci_mcasp_volatile_reg(struct device *dev, unsigned int reg)
+{
+	struct davinci_mcasp *mcasp = dev_get_drvdata(dev);
+
+	switch (reg) {
+	case DAVINCI_MCASP_PID_REG:
+	case DAVINCI_MCASP_PDSET_REG:
+	case DAVINCI_MCASP_PDCLR_REG:
+	case DAVINCI_MCASP_GBLCTL_REG:
+	case DAVINCI_MCASP_GBLCTLR_REG:
+	case DAVINCI_MCASP_RXSTAT_REG:
+	case DAVINCI_MCASP_RXTDMSLOT_REG:
+	case DAVINCI_MCASP_RXCLKCHK_REG:
+	case DAVINCI_MCASP_GBLCTLX_REG:
+	case DAVINCI_MCASP_TXSTAT_REG:
+	case DAVINCI_MCASP_TXTDMSLOT_REG:
+	case DAVINCI_MCASP_TXCLKCHK_REG:
+		return true;
+	}
+
+	if (reg == mcasp->fifo_base + MCASP_WFIFOSTS_OFFSET ||
+	    reg == mcasp->fifo_base + MCASP_RFIFOSTS_OFFSET)
+		return true;
+
+	return false;
+}
+
+static const struct regmap_config davinci_mcasp_regmap_config = {
+	.reg_bits = 32,
+	.val_bits = 32,
+	.reg_stride = 4,
+	.readable_reg = davinci_mcasp_readable_reg,
+	.writeable_reg = davinci_mcasp_writeable_reg,
+	.volatile_reg = davinci_mcasp_volatile_reg,
+	.cache_type = REGCACHE_FLAT,
+};
+
+/*
+ * Reads of the non-volatile registers are served from the register cache
+ * and the helpers below skip the bus write when the value does not change.
+ */
 static inline void mcasp_set_bits(struct davinci_mcasp *mcasp, u32 offset,
 				  u32 val)
 {
-	void __iomem *reg = mcasp->base + offset;
-	__raw_writel(__raw_readl(reg) | val, reg);
+	regmap_update_bits(mcasp->regmap, offset, val, val);
 }
 
 static inline void mcasp_clr_bits(struct davinci_mcasp *mcasp, u32 offset,
 				  u32 val)
 {
-	void __iomem *reg = mcasp->base + offset;
-	__raw_writel((__raw_readl(reg) & ~(val)), reg);
+	regmap_update_bits(mcasp->regmap, offset, val, 0);
 }
 
 static inline void mcasp_mod_bits(struct davinci_mcasp *mcasp, u32 offset,
 				  u32 val, u32 mask)
 {
-	void __iomem *reg = mcasp->base + offset;
-	__raw_writel((__raw_readl(reg) & ~mask) | val, reg);
+	regmap_update_bits(mcasp->regmap, offset, mask, val);
 }
 
 static inline void mcasp_set_reg(struct davinci_mcasp *mcasp, u32 offset,
 				 u32 val)
 {
-	__raw_writel(val, mcasp->base + offset);
+	/* status and control registers have to be written unconditionally */
+	if (davinci_mcasp_volatile_reg(mcasp->dev, offset))
+		regmap_write(mcasp->regmap, offset, val);
+	else
+		regmap_update_bits(mcasp->regmap, offset, ~0U, val);
 }
 
 static inline u32 mcasp_get_reg(struct davinci_mcasp *mcasp, u32 offset)
 {
-	return (u32)__raw_readl(mcasp->base + offset);
+	unsigned int val = 0;
+
+	regmap_read(mcasp->regmap, offset, &val);
+
+	return val;
 }
 
 static void mcasp_set_ctl_reg(struct davinci_mcasp *mcasp, u32 ctl_reg, u32 val)
@@ -170,6 +406,12 @@ static void mcasp_set_ctl_reg(struct davinci_mcasp *mcasp, u32 ctl_reg, u32 val)
 		printk(KERN_ERR "GBLCTL write error\n");
 }
 
+/* true if the stream is the capture clocked independently from TX */
+static bool davinci_mcasp_rx_async(struct davinci_mcasp *mcasp, int stream)
+{
+	return mcasp->rx_async && stream == SNDRV_PCM_STREAM_CAPTURE;
+}
+
 static bool mcasp_is_synchronous(struct davinci_mcasp *mcasp)
 {
 	u32 rxfmctl = mcasp_get_reg(mcasp, DAVINCI_MCASP_RXFMCTL_REG);
@@ -214,9 +456,30 @@ static void mcasp_start_rx(struct davinci_mcasp *mcasp)
 		       mcasp->irq_request[SNDRV_PCM_STREAM_CAPTURE]);
 }
 
-static void mcasp_start_tx(struct davinci_mcasp *mcasp)
+static void mcasp_tx_start_stats_update(struct davinci_mcasp *mcasp,
+					ktime_t start, int ret)
+{
+	struct davinci_mcasp_tx_start_stats *stats = &mcasp->tx_start_stats;
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	if (ret) {
+		stats->timeouts++;
+		return;
+	}
+
+	if (!stats->count || ns < stats->min_ns)
+		stats->min_ns = ns;
+	if (ns > stats->max_ns)
+		stats->max_ns = ns;
+	stats->total_ns += ns;
+	stats->count++;
+}
+
+static int mcasp_start_tx(struct davinci_mcasp *mcasp)
 {
-	u32 cnt;
+	unsigned int val;
+	ktime_t start;
+	int ret;
 
 	if (mcasp->txnumevt) {	/* enable FIFO */
 		u32 reg = mcasp->fifo_base + MCASP_WFIFOCTL_OFFSET;
@@ -231,11 +494,20 @@ static void mcasp_start_tx(struct davinci_mcasp *mcasp)
 	/* Activate serializer(s) */
 	mcasp_set_ctl_reg(mcasp, DAVINCI_MCASP_GBLCTLX_REG, TXSERCLR);
 
-	/* wait for XDATA to be cleared */
-	cnt = 0;
-	while ((mcasp_get_reg(mcasp, DAVINCI_MCASP_TXSTAT_REG) & XRDATA) &&
-	       (cnt < 100000))
-		cnt++;
+	/*
+	 * Wait for XDATA to be cleared. We are called from the trigger
+	 * callback in atomic context, so busy-wait without sleeping.
+	 */
+	start = ktime_get();
+	ret = regmap_read_poll_timeout(mcasp->regmap, DAVINCI_MCASP_TXSTAT_REG,
+				       val, !(val & XRDATA), 0,
+				       MCASP_XRDATA_TIMEOUT_US);
+	mcasp_tx_start_stats_update(mcasp, start, ret);
+	if (ret) {
+		/* the core issues TRIGGER_STOP which resets the TX section */
+		dev_err(mcasp->dev, "timeout waiting for XRDATA to clear\n");
+		return ret;
+	}
 
 	/* Release TX state machine */
 	mcasp_set_ctl_reg(mcasp, DAVINCI_MCASP_GBLCTLX_REG, TXSMRST);
@@ -245,16 +517,266 @@ static void mcasp_start_tx(struct davinci_mcasp *mcasp)
 	/* enable transmit IRQs */
 	mcasp_set_bits(mcasp, DAVINCI_MCASP_EVTCTLX_REG,
 		       mcasp->irq_request[SNDRV_PCM_STREAM_PLAYBACK]);
+
+	return 0;
+}
+
+static const u32 davinci_mcasp_clkchk_regs[2] = {
+	[SNDRV_PCM_STREAM_PLAYBACK] = DAVINCI_MCASP_TXCLKCHK_REG,
+	[SNDRV_PCM_STREAM_CAPTURE] = DAVINCI_MCASP_RXCLKCHK_REG,
+};
+
+static const u32 davinci_mcasp_stat_regs[2] = {
+	[SNDRV_PCM_STREAM_PLAYBACK] = DAVINCI_MCASP_TXSTAT_REG,
+	[SNDRV_PCM_STREAM_CAPTURE] = DAVINCI_MCASP_RXSTAT_REG,
+};
+
+/*
+ * The clock check circuit counts McASP functional clocks over 32 cycles of
+ * the high-frequency clock. The prescaler divides the functional clock, it
+ * is left at 1 which gives the most counts: 31.25 with a 24 MHz functional
+ * clock and a 24.576 MHz AHCLK, only 15.6 at 49.152 MHz (1024fs).
+ */
+static u32 davinci_mcasp_clkchk_freq(struct davinci_mcasp *mcasp, u8 count)
+{
+	/* a saturated count means no or a too slow clock */
+	if (!count || count == 0xff)
+		return 0;
+
+	return div_u64((u64)mcasp->fclk_rate * 32, count);
+}
+
+/*
+ * Take one sample of the clock check of a direction. XCKFAIL is set by the
+ * hardware when the count leaves the XMIN..XMAX window, which is kept at
+ * the last count +-1. A failure with an unchanged count is a stopped clock,
+ * otherwise the clock changed its frequency. Called with the lock held.
+ */
+static void davinci_mcasp_clkchk_sample(struct davinci_mcasp *mcasp,
+					int stream)
+{
+	struct davinci_mcasp_clkchk *chk = &mcasp->clkchk[stream];
+	u32 chk_reg = davinci_mcasp_clkchk_regs[stream];
+	u32 stat_reg = davinci_mcasp_stat_regs[stream];
+	u32 stat = mcasp_get_reg(mcasp, stat_reg);
+	u8 count = CLKCHK_CNT(mcasp_get_reg(mcasp, chk_reg));
+	bool lost = false;
+
+	chk->samples++;
+
+	if ((stat & XCKFAIL) && chk->count) {
+		if (count == chk->count) {
+			lost = true;
+			chk->loss++;
+		} else {
+			chk->change++;
+		}
+	}
+
+	if (count != chk->count) {
+		mcasp_mod_bits(mcasp, chk_reg,
+			       CLKCHK_MIN(count ? count - 1 : 0) |
+			       CLKCHK_MAX(count < 0xff ? count + 1 : 0xff),
+			       CLKCHK_MINMAX_MASK);
+		chk->count = count;
+	}
+
+	/* also drops a failure flagged against the previous window */
+	if (stat & XCKFAIL)
+		mcasp_set_reg(mcasp, stat_reg, XCKFAIL);
+
+	chk->freq = lost ? 0 : davinci_mcasp_clkchk_freq(mcasp, count);
+}
+
+static void davinci_mcasp_clkchk_work(struct work_struct *work)
+{
+	struct davinci_mcasp *mcasp = container_of(to_delayed_work(work),
+						   struct davinci_mcasp,
+						   clkchk_work);
+
+	spin_lock_irq(&mcasp->lock);
+
+	if (!mcasp->streams) {
+		spin_unlock_irq(&mcasp->lock);
+		return;
+	}
+
+	/* only a running divider keeps the measurement going */
+	if (mcasp_get_reg(mcasp, DAVINCI_MCASP_GBLCTLX_REG) & TXHCLKRST)
+		davinci_mcasp_clkchk_sample(mcasp, SNDRV_PCM_STREAM_PLAYBACK);
+	if (mcasp_get_reg(mcasp, DAVINCI_MCASP_GBLCTLR_REG) & RXHCLKRST)
+		davinci_mcasp_clkchk_sample(mcasp, SNDRV_PCM_STREAM_CAPTURE);
+
+	spin_unlock_irq(&mcasp->lock);
+
+	schedule_delayed_work(&mcasp->clkchk_work,
+			      msecs_to_jiffies(MCASP_CLKCHK_INTERVAL_MS));
 }
 
-static void davinci_mcasp_start(struct davinci_mcasp *mcasp, int stream)
+/*
+ * Measure the high-frequency clock of a direction, releasing its divider
+ * for the measurement if the direction is not running.
+ */
+static u32 davinci_mcasp_clkchk_measure(struct davinci_mcasp *mcasp,
+					int stream)
 {
+	u32 ctl_reg, hclkrst, ctl;
+	unsigned long flags;
+	u32 freq;
+
+	if (stream == SNDRV_PCM_STREAM_PLAYBACK) {
+		ctl_reg = DAVINCI_MCASP_GBLCTLX_REG;
+		hclkrst = TXHCLKRST;
+	} else {
+		ctl_reg = DAVINCI_MCASP_GBLCTLR_REG;
+		hclkrst = RXHCLKRST;
+	}
+
+	spin_lock_irqsave(&mcasp->lock, flags);
+
+	ctl = mcasp_get_reg(mcasp, ctl_reg);
+	if (!(ctl & hclkrst)) {
+		mcasp_set_ctl_reg(mcasp, ctl_reg, hclkrst);
+		udelay(MCASP_CLKCHK_SETTLE_US);
+	}
+
+	/* a fresh measurement, do not count it as an event */
+	mcasp->clkchk[stream].count = 0;
+	davinci_mcasp_clkchk_sample(mcasp, stream);
+	freq = mcasp->clkchk[stream].freq;
+
+	if (!(ctl & hclkrst))
+		mcasp_set_reg(mcasp, ctl_reg, ctl);
+
+	spin_unlock_irqrestore(&mcasp->lock, flags);
+
+	return freq;
+}
+
+/*
+ * True if the measured count is less than one count away from the exact,
+ * unrounded count of the expected clock. The count of a clock is its exact
+ * count rounded up or down, so the 8.8% apart 44.1 kHz and 48 kHz families
+ * stay distinct down to 15.6 vs 17.0 counts at 1024fs with a 24 MHz
+ * functional clock. Rounding the expected count first would let 16 match
+ * both.
+ */
+static bool davinci_mcasp_clkchk_match(struct davinci_mcasp *mcasp, u8 count,
+				       u64 expected)
+{
+	u64 counted = (u64)count * expected;
+	u64 exact = (u64)mcasp->fclk_rate * 32;
+
+	return counted < exact + expected && counted + expected > exact;
+}
+
+/* true if the count fits a 2^n or 3 * 2^n multiple of the rate */
+static bool davinci_mcasp_clkchk_match_rate(struct davinci_mcasp *mcasp,
+					    u8 count, unsigned int rate)
+{
+	int k;
+
+	for (k = 0; k <= 12; k++) {
+		if (davinci_mcasp_clkchk_match(mcasp, count, (u64)rate << k) ||
+		    davinci_mcasp_clkchk_match(mcasp, count,
+					       (u64)rate * 3 << k))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Compare the external high-frequency clock of a direction with the rate
+ * of hw_params. Against the sysclk if the machine driver announced one,
+ * else against any 2^n or 3 * 2^n multiple of the rate, as in slave mode.
+ */
+static int davinci_mcasp_clkchk_verify(struct davinci_mcasp *mcasp,
+				       int stream, unsigned int rate)
+{
+	bool async = davinci_mcasp_rx_async(mcasp, stream);
+	u32 ahclk_reg = DAVINCI_MCASP_AHCLKXCTL_REG;
+	u32 ahclke = AHCLKXE;
+	int sysclk = mcasp->sysclk_freq;
+	int dir = SNDRV_PCM_STREAM_PLAYBACK;
+	struct davinci_mcasp_clkchk *chk;
+	bool match = false;
+	u32 freq = 0;
+	int try;
+
+	if (!mcasp->fclk_rate)
+		return 0;
+
+	/* the sync capture runs from the TX clocks */
+	if (async) {
+		ahclk_reg = DAVINCI_MCASP_AHCLKRCTL_REG;
+		ahclke = AHCLKRE;
+		sysclk = mcasp->rx_sysclk_freq;
+		dir = SNDRV_PCM_STREAM_CAPTURE;
+	}
+
+	/* an internally generated clock is right by construction */
+	if (mcasp_get_reg(mcasp, ahclk_reg) & ahclke)
+		return 0;
+
+	chk = &mcasp->clkchk[dir];
+
+	/* the source may just have been switched by the machine driver */
+	for (try = 0; try < 2 && !match; try++) {
+		if (try)
+			usleep_range(1000, 2000);
+
+		freq = davinci_mcasp_clkchk_measure(mcasp, dir);
+		if (!freq)
+			break;
+
+		if (sysclk)
+			match = davinci_mcasp_clkchk_match(mcasp, chk->count,
+							   sysclk);
+		else
+			match = davinci_mcasp_clkchk_match_rate(mcasp,
+							chk->count, rate);
+	}
+
+	/* nothing to compare without a clock, the DAI may not use AHCLK */
+	if (!freq || match)
+		return 0;
+
+	chk->mismatch++;
+	if (sysclk)
+		dev_warn(mcasp->dev, "%s clock measured %u Hz, expected %d Hz\n",
+			 dir ? "RX" : "TX", freq, sysclk);
+	else
+		dev_warn(mcasp->dev, "%s clock measured %u Hz, no multiple of %u Hz\n",
+			 dir ? "RX" : "TX", freq, rate);
+
+	return clkchk_strict ? -EINVAL : 0;
+}
+
+static int davinci_mcasp_start(struct davinci_mcasp *mcasp, int stream)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	/* the sync mode shares the TX clocks, do not race the other stream */
+	spin_lock_irqsave(&mcasp->lock, flags);
+
+	/* counted even on failure, the following stop balances it */
 	mcasp->streams++;
 
 	if (stream == SNDRV_PCM_STREAM_PLAYBACK)
-		mcasp_start_tx(mcasp);
+		ret = mcasp_start_tx(mcasp);
 	else
 		mcasp_start_rx(mcasp);
+
+	/* the first sample reprograms the window, events start after it */
+	if (mcasp->fclk_rate) {
+		mcasp->clkchk[stream].count = 0;
+		schedule_delayed_work(&mcasp->clkchk_work, 0);
+	}
+
+	spin_unlock_irqrestore(&mcasp->lock, flags);
+	return ret;
 }
 
 static void mcasp_stop_rx(struct davinci_mcasp *mcasp)
@@ -307,42 +829,121 @@ static void mcasp_stop_tx(struct davinci_mcasp *mcasp)
 
 static void davinci_mcasp_stop(struct davinci_mcasp *mcasp, int stream)
 {
+	unsigned long flags;
+
+	spin_lock_irqsave(&mcasp->lock, flags);
+
 	mcasp->streams--;
 
 	if (stream == SNDRV_PCM_STREAM_PLAYBACK)
 		mcasp_stop_tx(mcasp);
 	else
 		mcasp_stop_rx(mcasp);
+
+	spin_unlock_irqrestore(&mcasp->lock, flags);
+}
+
+/*
+ * Record an XRUN event in the log. Slots are claimed with an atomic sequence
+ * number so that the TX and RX threads can log concurrently. The sequence
+ * is published last, a reader seeing a changed sequence drops the entry.
+ * Must be called with the stream lock held when substream is not NULL.
+ */
+static void davinci_mcasp_xrun_log(struct davinci_mcasp *mcasp, int stream,
+				   u32 stat, struct snd_pcm_substream *substream)
+{
+	struct davinci_mcasp_xrun_event *ev;
+	struct snd_pcm_runtime *runtime;
+	unsigned int seq;
+	u32 reg;
+
+	seq = atomic_inc_return(&mcasp->xrun_seq);
+	ev = &mcasp->xrun_log[(seq - 1) & (MCASP_XRUN_LOG_SIZE - 1)];
+
+	WRITE_ONCE(ev->seq, 0);
+	smp_wmb();
+
+	ev->time = ktime_get();
+	ev->stream = stream;
+	ev->stat = stat;
+
+	ev->fifo_level = 0;
+	if (stream == SNDRV_PCM_STREAM_PLAYBACK) {
+		reg = mcasp->fifo_base + MCASP_WFIFOSTS_OFFSET;
+		if (mcasp->txnumevt)
+			ev->fifo_level = mcasp_get_reg(mcasp, reg) &
+					 FIFO_LVL_MASK;
+	} else {
+		reg = mcasp->fifo_base + MCASP_RFIFOSTS_OFFSET;
+		if (mcasp->rxnumevt)
+			ev->fifo_level = mcasp_get_reg(mcasp, reg) &
+					 FIFO_LVL_MASK;
+	}
+
+	runtime = substream ? substream->runtime : NULL;
+	if (runtime) {
+		ev->position = substream->ops->pointer(substream);
+		ev->buffer_size = runtime->buffer_size;
+		ev->rate = runtime->rate;
+		ev->format = runtime->format;
+		ev->channels = runtime->channels;
+	} else {
+		ev->position = 0;
+		ev->buffer_size = 0;
+		ev->rate = 0;
+		ev->format = 0;
+		ev->channels = 0;
+	}
+
+	smp_wmb();
+	WRITE_ONCE(ev->seq, seq);
+}
+
+static void davinci_mcasp_xrun(struct davinci_mcasp *mcasp, int stream,
+			       u32 stat)
+{
+	struct snd_pcm_substream *substream = mcasp->substreams[stream];
+
+	atomic_inc(&mcasp->xrun_count[stream][MCASP_XRUN_FIFO]);
+
+	if (!substream) {
+		davinci_mcasp_xrun_log(mcasp, stream, stat, NULL);
+		return;
+	}
+
+	snd_pcm_stream_lock_irq(substream);
+	davinci_mcasp_xrun_log(mcasp, stream, stat, substream);
+	if (snd_pcm_running(substream))
+		snd_pcm_stop(substream, SNDRV_PCM_STATE_XRUN);
+	snd_pcm_stream_unlock_irq(substream);
 }
 
 static irqreturn_t davinci_mcasp_tx_irq_handler(int irq, void *data)
 {
 	struct davinci_mcasp *mcasp = (struct davinci_mcasp *)data;
-	struct snd_pcm_substream *substream;
+	atomic_t *count = mcasp->xrun_count[SNDRV_PCM_STREAM_PLAYBACK];
 	u32 irq_mask = mcasp->irq_request[SNDRV_PCM_STREAM_PLAYBACK];
 	u32 handled_mask = 0;
 	u32 stat;
 
 	stat = mcasp_get_reg(mcasp, DAVINCI_MCASP_TXSTAT_REG);
 	if (stat & XUNDRN & irq_mask) {
-		dev_warn(mcasp->dev, "Transmit buffer underflow\n");
+		dev_dbg(mcasp->dev, "Transmit buffer underflow\n");
 		handled_mask |= XUNDRN;
 
-		substream = mcasp->substreams[SNDRV_PCM_STREAM_PLAYBACK];
-		if (substream) {
-			snd_pcm_stream_lock_irq(substream);
-			if (snd_pcm_running(substream))
-				snd_pcm_stop(substream, SNDRV_PCM_STATE_XRUN);
-			snd_pcm_stream_unlock_irq(substream);
-		}
+		davinci_mcasp_xrun(mcasp, SNDRV_PCM_STREAM_PLAYBACK, stat);
 	}
 
-	if (!handled_mask)
-		dev_warn(mcasp->dev, "unhandled tx event. txstat: 0x%08x\n",
-			 stat);
+	if (!handled_mask) {
+		atomic_inc(&count[MCASP_XRUN_UNHANDLED]);
+		dev_dbg(mcasp->dev, "unhandled tx event. txstat: 0x%08x\n",
+			stat);
+	}
 
-	if (stat & XRERR)
+	if (stat & XRERR) {
+		atomic_inc(&count[MCASP_XRUN_XRERR]);
 		handled_mask |= XRERR;
+	}
 
 	/* Ack the handled event only */
 	mcasp_set_reg(mcasp, DAVINCI_MCASP_TXSTAT_REG, handled_mask);
@@ -353,31 +954,29 @@ static irqreturn_t davinci_mcasp_tx_irq_handler(int irq, void *data)
 static irqreturn_t davinci_mcasp_rx_irq_handler(int irq, void *data)
 {
 	struct davinci_mcasp *mcasp = (struct davinci_mcasp *)data;
-	struct snd_pcm_substream *substream;
+	atomic_t *count = mcasp->xrun_count[SNDRV_PCM_STREAM_CAPTURE];
 	u32 irq_mask = mcasp->irq_request[SNDRV_PCM_STREAM_CAPTURE];
 	u32 handled_mask = 0;
 	u32 stat;
 
 	stat = mcasp_get_reg(mcasp, DAVINCI_MCASP_RXSTAT_REG);
 	if (stat & ROVRN & irq_mask) {
-		dev_warn(mcasp->dev, "Receive buffer overflow\n");
+		dev_dbg(mcasp->dev, "Receive buffer overflow\n");
 		handled_mask |= ROVRN;
 
-		substream = mcasp->substreams[SNDRV_PCM_STREAM_CAPTURE];
-		if (substream) {
-			snd_pcm_stream_lock_irq(substream);
-			if (snd_pcm_running(substream))
-				snd_pcm_stop(substream, SNDRV_PCM_STATE_XRUN);
-			snd_pcm_stream_unlock_irq(substream);
-		}
+		davinci_mcasp_xrun(mcasp, SNDRV_PCM_STREAM_CAPTURE, stat);
 	}
 
-	if (!handled_mask)
-		dev_warn(mcasp->dev, "unhandled rx event. rxstat: 0x%08x\n",
-			 stat);
+	if (!handled_mask) {
+		atomic_inc(&count[MCASP_XRUN_UNHANDLED]);
+		dev_dbg(mcasp->dev, "unhandled rx event. rxstat: 0x%08x\n",
+			stat);
+	}
 
-	if (stat & XRERR)
+	if (stat & XRERR) {
+		atomic_inc(&count[MCASP_XRUN_XRERR]);
 		handled_mask |= XRERR;
+	}
 
 	/* Ack the handled event only */
 	mcasp_set_reg(mcasp, DAVINCI_MCASP_RXSTAT_REG, handled_mask);
@@ -569,6 +1168,16 @@ static int __davinci_mcasp_set_clkdiv(struct davinci_mcasp *mcasp, int div_id,
 	case MCASP_CLKDIV_AUXCLK:			/* MCLK divider */
 		mcasp_mod_bits(mcasp, DAVINCI_MCASP_AHCLKXCTL_REG,
 			       AHCLKXDIV(div - 1), AHCLKXDIV_MASK);
+		if (!mcasp->rx_async)
+			mcasp_mod_bits(mcasp, DAVINCI_MCASP_AHCLKRCTL_REG,
+				       AHCLKRDIV(div - 1), AHCLKRDIV_MASK);
+		break;
+
+	case MCASP_CLKDIV_AUXCLK_RX:
+		if (!mcasp->rx_async) {
+			ret = -EINVAL;
+			goto out;
+		}
 		mcasp_mod_bits(mcasp, DAVINCI_MCASP_AHCLKRCTL_REG,
 			       AHCLKRDIV(div - 1), AHCLKRDIV_MASK);
 		break;
@@ -582,12 +1191,22 @@ static int __davinci_mcasp_set_clkdiv(struct davinci_mcasp *mcasp, int div_id,
 		}
 		mcasp_mod_bits(mcasp, DAVINCI_MCASP_ACLKXCTL_REG,
 			       ACLKXDIV(div - 1), ACLKXDIV_MASK);
-		mcasp_mod_bits(mcasp, DAVINCI_MCASP_ACLKRCTL_REG,
-			       ACLKRDIV(div - 1), ACLKRDIV_MASK);
+		if (!mcasp->rx_async)
+			mcasp_mod_bits(mcasp, DAVINCI_MCASP_ACLKRCTL_REG,
+				       ACLKRDIV(div - 1), ACLKRDIV_MASK);
 		if (explicit)
 			mcasp->bclk_div = div;
 		break;
 
+	case MCASP_CLKDIV_BCLK_RX:
+		if (!mcasp->rx_async || div < 1 || 32 < div) {
+			ret = -EINVAL;
+			goto out;
+		}
+		mcasp_mod_bits(mcasp, DAVINCI_MCASP_ACLKRCTL_REG,
+			       ACLKRDIV(div - 1), ACLKRDIV_MASK);
+		break;
+
 	case MCASP_CLKDIV_BCLK_FS_RATIO:
 		/*
 		 * BCLK/LRCLK ratio descries how many bit-clock cycles
@@ -623,28 +1242,95 @@ static int davinci_mcasp_set_clkdiv(struct snd_soc_dai *dai, int div_id,
 	return __davinci_mcasp_set_clkdiv(mcasp, div_id, div, 1);
 }
 
-static int davinci_mcasp_set_sysclk(struct snd_soc_dai *dai, int clk_id,
-				    unsigned int freq, int dir)
+static void davinci_mcasp_update_rate_table(struct davinci_mcasp *mcasp);
+
+/*
+ * In the async RX mode the receive section takes its high-frequency clock
+ * from AHCLKR: either the AHCLKR pin (SND_SOC_CLOCK_IN) or AUXCLK
+ * (SND_SOC_CLOCK_OUT, the pin is not driven). ACLKR and AFSR are generated
+ * from it by the MCASP_CLKDIV_*_RX dividers. A zero freq returns RX to the
+ * TX clocks, which takes effect with the next hw_params of the capture.
+ */
+static int davinci_mcasp_set_rx_sysclk(struct davinci_mcasp *mcasp,
+				       unsigned int freq, int dir)
 {
-	struct davinci_mcasp *mcasp = snd_soc_dai_get_drvdata(dai);
+	u32 ahclkxctl;
+
+	pm_runtime_get_sync(mcasp->dev);
+	if (!freq) {
+		/* follow the AHCLKX setup again */
+		ahclkxctl = mcasp_get_reg(mcasp, DAVINCI_MCASP_AHCLKXCTL_REG);
+		mcasp_mod_bits(mcasp, DAVINCI_MCASP_AHCLKRCTL_REG,
+			       (ahclkxctl & AHCLKXE) ? AHCLKRE : 0, AHCLKRE);
+		mcasp_mod_bits(mcasp, DAVINCI_MCASP_AHCLKRCTL_REG,
+			       AHCLKRDIV(AHCLKXDIV_MASK & ahclkxctl),
+			       AHCLKRDIV_MASK);
+	} else if (dir == SND_SOC_CLOCK_OUT) {
+		mcasp_set_bits(mcasp, DAVINCI_MCASP_AHCLKRCTL_REG, AHCLKRE);
+	} else {
+		mcasp_clr_bits(mcasp, DAVINCI_MCASP_AHCLKRCTL_REG, AHCLKRE);
+		mcasp_clr_bits(mcasp, DAVINCI_MCASP_PDIR_REG, AHCLKR);
+	}
+
+	mcasp->rx_async = freq != 0;
+	mcasp->rx_sysclk_freq = freq;
+
+	pm_runtime_put(mcasp->dev);
+	return 0;
+}
 
+static int __davinci_mcasp_set_sysclk(struct davinci_mcasp *mcasp,
+				      unsigned int freq, int dir)
+{
 	pm_runtime_get_sync(mcasp->dev);
 	if (dir == SND_SOC_CLOCK_OUT) {
 		mcasp_set_bits(mcasp, DAVINCI_MCASP_AHCLKXCTL_REG, AHCLKXE);
-		mcasp_set_bits(mcasp, DAVINCI_MCASP_AHCLKRCTL_REG, AHCLKRE);
+		if (!mcasp->rx_async)
+			mcasp_set_bits(mcasp, DAVINCI_MCASP_AHCLKRCTL_REG,
+				       AHCLKRE);
 		mcasp_set_bits(mcasp, DAVINCI_MCASP_PDIR_REG, AHCLKX);
 	} else {
 		mcasp_clr_bits(mcasp, DAVINCI_MCASP_AHCLKXCTL_REG, AHCLKXE);
-		mcasp_clr_bits(mcasp, DAVINCI_MCASP_AHCLKRCTL_REG, AHCLKRE);
+		if (!mcasp->rx_async)
+			mcasp_clr_bits(mcasp, DAVINCI_MCASP_AHCLKRCTL_REG,
+				       AHCLKRE);
 		mcasp_clr_bits(mcasp, DAVINCI_MCASP_PDIR_REG, AHCLKX);
 	}
 
 	mcasp->sysclk_freq = freq;
+	davinci_mcasp_update_rate_table(mcasp);
 
 	pm_runtime_put(mcasp->dev);
 	return 0;
 }
 
+static int davinci_mcasp_set_sysclk(struct snd_soc_dai *dai, int clk_id,
+				    unsigned int freq, int dir)
+{
+	struct davinci_mcasp *mcasp = snd_soc_dai_get_drvdata(dai);
+	int ret;
+
+	/* the loopback test bypasses the register cache */
+	spin_lock_irq(&mcasp->lock);
+	if (mcasp->loopback_running) {
+		spin_unlock_irq(&mcasp->lock);
+		return -EBUSY;
+	}
+	mcasp->sysclk_changes++;
+	spin_unlock_irq(&mcasp->lock);
+
+	if (clk_id == MCASP_SYSCLK_RX)
+		ret = davinci_mcasp_set_rx_sysclk(mcasp, freq, dir);
+	else
+		ret = __davinci_mcasp_set_sysclk(mcasp, freq, dir);
+
+	spin_lock_irq(&mcasp->lock);
+	mcasp->sysclk_changes--;
+	spin_unlock_irq(&mcasp->lock);
+
+	return ret;
+}
+
 /* All serializers must have equal number of channels */
 static int davinci_mcasp_ch_constraint(struct davinci_mcasp *mcasp, int stream,
 				       int serializers)
@@ -719,14 +1405,27 @@ static int davinci_mcasp_set_tdm_slot(struct snd_soc_dai *dai,
 	mcasp->tdm_mask[SNDRV_PCM_STREAM_PLAYBACK] = tx_mask;
 	mcasp->tdm_mask[SNDRV_PCM_STREAM_CAPTURE] = rx_mask;
 	mcasp->slot_width = slot_width;
+	davinci_mcasp_update_rate_table(mcasp);
 
 	return davinci_mcasp_set_ch_constraints(mcasp);
 }
 
-static int davinci_config_channel_size(struct davinci_mcasp *mcasp,
-				       int sample_width)
+/* Slot size, rotation and mask of the serializer format */
+struct davinci_mcasp_slot_fmt {
+	u32 ssz;
+	u32 tx_rotate;
+	u32 rx_rotate;
+	u32 mask;
+};
+
+/*
+ * Serializer format for a sample width, used by hw_params and by the
+ * loopback test which checks it.
+ */
+static void davinci_mcasp_slot_fmt(struct davinci_mcasp *mcasp,
+				   int sample_width,
+				   struct davinci_mcasp_slot_fmt *sf)
 {
-	u32 fmt;
 	u32 tx_rotate = (sample_width / 4) & 0x7;
 	u32 mask = (1ULL << sample_width) - 1;
 	u32 slot_width = sample_width;
@@ -767,7 +1466,7 @@ static int davinci_config_channel_size(struct davinci_mcasp *mcasp,
 	}
 
 	/* mapping of the XSSZ bit-field as described in the datasheet */
-	fmt = (slot_width >> 1) - 1;
+	sf->ssz = (slot_width >> 1) - 1;
 
 	if (mcasp->right_justified) {
 		tx_rotate = 0;
@@ -776,42 +1475,42 @@ static int davinci_config_channel_size(struct davinci_mcasp *mcasp,
 
 	if (mcasp->op_mode == DAVINCI_MCASP_DIT_MODE) {
 		/* DIT requires 32-bit slot size */
-		fmt = 0xf;
+		sf->ssz = 0xf;
 	}
 
-	mcasp_mod_bits(mcasp, DAVINCI_MCASP_RXFMT_REG, RXSSZ(fmt),
+	sf->tx_rotate = tx_rotate;
+	sf->rx_rotate = rx_rotate;
+	sf->mask = mask;
+}
+
+static int davinci_config_channel_size(struct davinci_mcasp *mcasp,
+				       int sample_width)
+{
+	struct davinci_mcasp_slot_fmt sf;
+
+	davinci_mcasp_slot_fmt(mcasp, sample_width, &sf);
+
+	mcasp_mod_bits(mcasp, DAVINCI_MCASP_RXFMT_REG, RXSSZ(sf.ssz),
 			RXSSZ(0x0F));
-	mcasp_mod_bits(mcasp, DAVINCI_MCASP_TXFMT_REG, TXSSZ(fmt),
+	mcasp_mod_bits(mcasp, DAVINCI_MCASP_TXFMT_REG, TXSSZ(sf.ssz),
 			TXSSZ(0x0F));
-	mcasp_mod_bits(mcasp, DAVINCI_MCASP_TXFMT_REG, TXROT(tx_rotate),
+	mcasp_mod_bits(mcasp, DAVINCI_MCASP_TXFMT_REG, TXROT(sf.tx_rotate),
 			TXROT(7));
-	mcasp_mod_bits(mcasp, DAVINCI_MCASP_RXFMT_REG, RXROT(rx_rotate),
+	mcasp_mod_bits(mcasp, DAVINCI_MCASP_RXFMT_REG, RXROT(sf.rx_rotate),
 			RXROT(7));
-	mcasp_set_reg(mcasp, DAVINCI_MCASP_RXMASK_REG, mask);
+	mcasp_set_reg(mcasp, DAVINCI_MCASP_RXMASK_REG, sf.mask);
 
-	mcasp_set_reg(mcasp, DAVINCI_MCASP_TXMASK_REG, mask);
+	mcasp_set_reg(mcasp, DAVINCI_MCASP_TXMASK_REG, sf.mask);
 
 	return 0;
 }
 
-static int mcasp_common_hw_param(struct davinci_mcasp *mcasp, int stream,
-				 int period_words, int channels)
+/* Frame sync and bit clock pins which are unused in DIT and DSD modes */
+static void mcasp_pins_hw_param(struct davinci_mcasp *mcasp, int stream)
 {
-	struct snd_dmaengine_dai_dma_data *dma_data = &mcasp->dma_data[stream];
-	int i;
-	u8 tx_ser = 0;
-	u8 rx_ser = 0;
-	u8 slots = mcasp->dsd_mode[stream] ? 1 : mcasp->tdm_slots;
-	u8 max_active_serializers = (channels + slots - 1) / slots;
-	int active_serializers, numevt;
-	u32 reg;
 	u32 disable_pins;
 	u32 disable_pins_mask;
 
-	/* Default configuration */
-	if (mcasp->version < MCASP_VERSION_3)
-		mcasp_set_bits(mcasp, DAVINCI_MCASP_PWREMUMGT_REG, MCASP_SOFT);
-
 	if (stream != SNDRV_PCM_STREAM_PLAYBACK) {
 		/* do not modify receiving pins */
 		disable_pins = 0;
@@ -831,30 +1530,40 @@ static int mcasp_common_hw_param(struct davinci_mcasp *mcasp, int stream,
 			disable_pins_mask);
 	mcasp_clr_bits(mcasp, DAVINCI_MCASP_PDOUT_REG, disable_pins);
 	mcasp_set_bits(mcasp, DAVINCI_MCASP_PDIR_REG, disable_pins);
+}
 
-	if (stream == SNDRV_PCM_STREAM_PLAYBACK) {
-		mcasp_set_reg(mcasp, DAVINCI_MCASP_TXSTAT_REG, 0xFFFFFFFF);
-		mcasp_clr_bits(mcasp, DAVINCI_MCASP_XEVTCTL_REG, TXDATADMADIS);
-	} else {
-		mcasp_set_reg(mcasp, DAVINCI_MCASP_RXSTAT_REG, 0xFFFFFFFF);
-		mcasp_clr_bits(mcasp, DAVINCI_MCASP_REVTCTL_REG, RXDATADMADIS);
-	}
+/* Serializer activation, AFIFO depth and the DMA burst size */
+static int mcasp_serializer_hw_param(struct davinci_mcasp *mcasp, int stream,
+				     int period_words, int channels)
+{
+	struct snd_dmaengine_dai_dma_data *dma_data = &mcasp->dma_data[stream];
+	u8 dir = stream == SNDRV_PCM_STREAM_PLAYBACK ? TX_MODE : RX_MODE;
+	u8 slots = mcasp->dsd_mode[stream] ? 1 : mcasp->tdm_slots;
+	u8 max_active_serializers = (channels + slots - 1) / slots;
+	int active_serializers = 0;
+	int i, numevt;
+	u32 reg;
 
 	for (i = 0; i < mcasp->num_serializer; i++) {
+		/* the serializers of the other direction may be running */
+		if (mcasp->serial_dir[i] != dir &&
+		    mcasp->serial_dir[i] != INACTIVE_MODE)
+			continue;
+
 		mcasp_set_bits(mcasp, DAVINCI_MCASP_XRSRCTL_REG(i),
 			       mcasp->serial_dir[i]);
 		if (mcasp->serial_dir[i] == TX_MODE &&
-					tx_ser < max_active_serializers) {
+					active_serializers < max_active_serializers) {
 			mcasp_clr_bits(mcasp, DAVINCI_MCASP_PFUNC_REG, AXR(i));
 			mcasp_set_bits(mcasp, DAVINCI_MCASP_PDIR_REG, AXR(i));
 			mcasp_mod_bits(mcasp, DAVINCI_MCASP_XRSRCTL_REG(i),
 				       DISMOD_LOW, DISMOD_MASK);
-			tx_ser++;
+			active_serializers++;
 		} else if (mcasp->serial_dir[i] == RX_MODE &&
-					rx_ser < max_active_serializers) {
+					active_serializers < max_active_serializers) {
 			mcasp_clr_bits(mcasp, DAVINCI_MCASP_PFUNC_REG, AXR(i));
 			mcasp_clr_bits(mcasp, DAVINCI_MCASP_PDIR_REG, AXR(i));
-			rx_ser++;
+			active_serializers++;
 		} else {
 			mcasp_mod_bits(mcasp, DAVINCI_MCASP_XRSRCTL_REG(i),
 				       SRMOD_INACTIVE, SRMOD_MASK);
@@ -862,11 +1571,9 @@ static int mcasp_common_hw_param(struct davinci_mcasp *mcasp, int stream,
 	}
 
 	if (stream == SNDRV_PCM_STREAM_PLAYBACK) {
-		active_serializers = tx_ser;
 		numevt = mcasp->txnumevt;
 		reg = mcasp->fifo_base + MCASP_WFIFOCTL_OFFSET;
 	} else {
-		active_serializers = rx_ser;
 		numevt = mcasp->rxnumevt;
 		reg = mcasp->fifo_base + MCASP_RFIFOCTL_OFFSET;
 	}
@@ -878,7 +1585,10 @@ static int mcasp_common_hw_param(struct davinci_mcasp *mcasp, int stream,
 		return -EINVAL;
 	}
 
+	mcasp->active_serializers[stream] = active_serializers;
+
 	/* AFIFO is not in use */
+	mcasp->afifo_numevt[stream] = 0;
 	if (!numevt) {
 		/* Configure the burst size for platform drivers */
 		if (active_serializers > 1) {
@@ -902,6 +1612,19 @@ static int mcasp_common_hw_param(struct davinci_mcasp *mcasp, int stream,
 		return -EINVAL;
 	}
 
+	switch (mcasp->afifo_policy[stream]) {
+	case MCASP_AFIFO_POLICY_LATENCY:
+		/* one word per serializer for every DMA event */
+		numevt = active_serializers;
+		break;
+	case MCASP_AFIFO_POLICY_THROUGHPUT:
+		/* as few DMA events as the AFIFO allows */
+		numevt = MCASP_MAX_AFIFO_DEPTH;
+		break;
+	default:
+		break;
+	}
+
 	/*
 	 * Calculate the optimal AFIFO depth for platform side:
 	 * The number of words for numevt need to be in steps of active
@@ -916,6 +1639,7 @@ static int mcasp_common_hw_param(struct davinci_mcasp *mcasp, int stream,
 
 	mcasp_mod_bits(mcasp, reg, active_serializers, NUMDMA_MASK);
 	mcasp_mod_bits(mcasp, reg, NUMEVT(numevt), NUMEVT_MASK);
+	mcasp->afifo_numevt[stream] = numevt;
 
 	/* Configure the burst size for platform drivers */
 	if (numevt == 1)
@@ -925,8 +1649,29 @@ static int mcasp_common_hw_param(struct davinci_mcasp *mcasp, int stream,
 	return 0;
 }
 
-static int mcasp_i2s_hw_param(struct davinci_mcasp *mcasp, int stream,
-			      int channels)
+static int mcasp_common_hw_param(struct davinci_mcasp *mcasp, int stream,
+				 int period_words, int channels)
+{
+	/* Default configuration */
+	if (mcasp->version < MCASP_VERSION_3)
+		mcasp_set_bits(mcasp, DAVINCI_MCASP_PWREMUMGT_REG, MCASP_SOFT);
+
+	mcasp_pins_hw_param(mcasp, stream);
+
+	if (stream == SNDRV_PCM_STREAM_PLAYBACK) {
+		mcasp_set_reg(mcasp, DAVINCI_MCASP_TXSTAT_REG, 0xFFFFFFFF);
+		mcasp_clr_bits(mcasp, DAVINCI_MCASP_XEVTCTL_REG, TXDATADMADIS);
+	} else {
+		mcasp_set_reg(mcasp, DAVINCI_MCASP_RXSTAT_REG, 0xFFFFFFFF);
+		mcasp_clr_bits(mcasp, DAVINCI_MCASP_REVTCTL_REG, RXDATADMADIS);
+	}
+
+	return mcasp_serializer_hw_param(mcasp, stream, period_words, channels);
+}
+
+/* Slot mask, bus selection and frame sync mode of the stream */
+static void mcasp_i2s_slot_param(struct davinci_mcasp *mcasp, int stream,
+				 int channels)
 {
 	int i, active_slots;
 	int total_slots;
@@ -967,7 +1712,6 @@ static int mcasp_i2s_hw_param(struct davinci_mcasp *mcasp, int stream,
 		for (i = 0; i < active_slots; i++)
 			mask |= (1 << i);
 	}
-	mcasp_clr_bits(mcasp, DAVINCI_MCASP_ACLKXCTL_REG, TX_ASYNC);
 
 	if (!mcasp->dat_port)
 		busel = TXSEL;
@@ -980,14 +1724,17 @@ static int mcasp_i2s_hw_param(struct davinci_mcasp *mcasp, int stream,
 		mod = total_slots;
 	}
 
+	/* busel is cleared for DSD, so it has to be a full update */
 	if (stream == SNDRV_PCM_STREAM_PLAYBACK) {
 		mcasp_set_reg(mcasp, DAVINCI_MCASP_TXTDM_REG, mask);
-		mcasp_set_bits(mcasp, DAVINCI_MCASP_TXFMT_REG, busel | TXORD);
+		mcasp_mod_bits(mcasp, DAVINCI_MCASP_TXFMT_REG, busel | TXORD,
+			       TXSEL | TXORD);
 		mcasp_mod_bits(mcasp, DAVINCI_MCASP_TXFMCTL_REG,
 			       FSXMOD(mod), FSXMOD(0x1FF));
 	} else if (stream == SNDRV_PCM_STREAM_CAPTURE) {
 		mcasp_set_reg(mcasp, DAVINCI_MCASP_RXTDM_REG, mask);
-		mcasp_set_bits(mcasp, DAVINCI_MCASP_RXFMT_REG, busel | RXORD);
+		mcasp_mod_bits(mcasp, DAVINCI_MCASP_RXFMT_REG, busel | RXORD,
+			       RXSEL | RXORD);
 		mcasp_mod_bits(mcasp, DAVINCI_MCASP_RXFMCTL_REG,
 			       FSRMOD(mod), FSRMOD(0x1FF));
 		/*
@@ -999,6 +1746,22 @@ static int mcasp_i2s_hw_param(struct davinci_mcasp *mcasp, int stream,
 			mcasp_mod_bits(mcasp, DAVINCI_MCASP_TXFMCTL_REG,
 				       FSXMOD(mod), FSXMOD(0x1FF));
 	}
+}
+
+static int mcasp_i2s_hw_param(struct davinci_mcasp *mcasp, int stream,
+			      int channels)
+{
+	if (davinci_mcasp_rx_async(mcasp, stream) && !mcasp->bclk_master) {
+		dev_err(mcasp->dev, "async RX needs McASP as BCLK master\n");
+		return -EINVAL;
+	}
+
+	if (mcasp->rx_async)
+		mcasp_set_bits(mcasp, DAVINCI_MCASP_ACLKXCTL_REG, TX_ASYNC);
+	else
+		mcasp_clr_bits(mcasp, DAVINCI_MCASP_ACLKXCTL_REG, TX_ASYNC);
+
+	mcasp_i2s_slot_param(mcasp, stream, channels);
 
 	/* Disable the DIT */
 	mcasp_clr_bits(mcasp, DAVINCI_MCASP_TXDITCTL_REG, DITEN);
@@ -1130,36 +1893,121 @@ static int davinci_mcasp_calc_clk_div(struct davinci_mcasp *mcasp,
 	return error_ppm;
 }
 
+/*
+ * Sample formats and their width in memory. The serializers shift the word
+ * MSB first after TXROT has moved it to the top of XBUF, so DSD formats
+ * whose first bit in time is the MSB of the little-endian word go out
+ * without any conversion. DSD_U16_BE and DSD_U32_BE keep the first bit in
+ * the lowest address byte: that needs a byte swap, which neither the
+ * rotation nor the bit order (TXORD) of the McASP can do, so they are not
+ * listed here.
+ */
+struct davinci_mcasp_format {
+	snd_pcm_format_t format;
+	u8	width;
+	bool	dsd;
+};
+
+static const struct davinci_mcasp_format davinci_mcasp_formats[] = {
+	{ SNDRV_PCM_FORMAT_U8,		8,	false },
+	{ SNDRV_PCM_FORMAT_S8,		8,	false },
+	{ SNDRV_PCM_FORMAT_U16_LE,	16,	false },
+	{ SNDRV_PCM_FORMAT_S16_LE,	16,	false },
+	{ SNDRV_PCM_FORMAT_U24_3LE,	24,	false },
+	{ SNDRV_PCM_FORMAT_S24_3LE,	24,	false },
+	{ SNDRV_PCM_FORMAT_U24_LE,	24,	false },
+	{ SNDRV_PCM_FORMAT_S24_LE,	24,	false },
+	{ SNDRV_PCM_FORMAT_U32_LE,	32,	false },
+	{ SNDRV_PCM_FORMAT_S32_LE,	32,	false },
+	{ SNDRV_PCM_FORMAT_DSD_U8,	8,	true },
+	{ SNDRV_PCM_FORMAT_DSD_U16_LE,	16,	true },
+	{ SNDRV_PCM_FORMAT_DSD_U32_LE,	32,	true },
+};
+
+static const struct davinci_mcasp_format *davinci_mcasp_find_format(
+	snd_pcm_format_t format)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(davinci_mcasp_formats); i++)
+		if (davinci_mcasp_formats[i].format == format)
+			return &davinci_mcasp_formats[i];
+
+	return NULL;
+}
+
 static int is_dsd(snd_pcm_format_t format)
 {
-	switch (format) {
-		case SNDRV_PCM_FORMAT_DSD_U8:
-		case SNDRV_PCM_FORMAT_DSD_U16_LE:
-		case SNDRV_PCM_FORMAT_DSD_U16_BE:
-		case SNDRV_PCM_FORMAT_DSD_U32_LE:
-		case SNDRV_PCM_FORMAT_DSD_U32_BE:
-			return 1;
-			break;
+	const struct davinci_mcasp_format *f = davinci_mcasp_find_format(format);
 
-		default:
-			return 0;
-			break;
-	}
+	return f && f->dsd;
 }
 
-static int davinci_mcasp_hw_params(struct snd_pcm_substream *substream,
-					struct snd_pcm_hw_params *params,
-					struct snd_soc_dai *cpu_dai)
+static int davinci_mcasp_word_length(snd_pcm_format_t format)
+{
+	const struct davinci_mcasp_format *f = davinci_mcasp_find_format(format);
+
+	return f ? f->width : -EINVAL;
+}
+
+/*
+ * A stream which only changes between PCM and DSD keeps the DAI format,
+ * the clocking and the serializer directions. It can be switched without
+ * going through the full hw_params sequence.
+ */
+static bool davinci_mcasp_is_dsd_switch(struct davinci_mcasp *mcasp,
+					int stream, bool dsd)
+{
+	struct davinci_mcasp_stream_state *state = &mcasp->stream_state[stream];
+
+	if (!state->valid || mcasp->op_mode != DAVINCI_MCASP_IIS_MODE)
+		return false;
+
+	/* an implicit BCLK divider has to be recalculated from the params */
+	if (mcasp->bclk_master && mcasp->bclk_div == 0 && mcasp->sysclk_freq)
+		return false;
+
+	return state->dsd != dsd && state->dai_fmt == mcasp->dai_fmt;
+}
+
+/*
+ * Apply the differences between the I2S and DSD register sets: the frame
+ * sync pin, the number of active serializers (DSD uses one slot per
+ * serializer), the slot mask and bus selection and the word size.
+ */
+static int davinci_mcasp_dsd_switch(struct snd_soc_dai *cpu_dai, int stream,
+				    int period_words, int channels,
+				    int word_length)
+{
+	struct davinci_mcasp *mcasp = snd_soc_dai_get_drvdata(cpu_dai);
+	int ret;
+
+	/* autogpio uses different pins for PCM and DSD */
+	ret = davinci_mcasp_mute_stream(cpu_dai, 1, stream);
+	if (ret)
+		return ret;
+
+	mcasp_pins_hw_param(mcasp, stream);
+
+	ret = mcasp_serializer_hw_param(mcasp, stream, period_words, channels);
+	if (ret)
+		return ret;
+
+	mcasp_i2s_slot_param(mcasp, stream, channels);
+
+	return davinci_config_channel_size(mcasp, word_length);
+}
+
+static int __davinci_mcasp_hw_params(struct snd_soc_dai *cpu_dai,
+				     struct snd_pcm_hw_params *params,
+				     int stream, int word_length)
 {
 	struct davinci_mcasp *mcasp = snd_soc_dai_get_drvdata(cpu_dai);
-	int word_length;
 	int channels = params_channels(params);
 	int period_size = params_period_size(params);
 	int ret;
 
-	mcasp->dsd_mode[substream->stream] = is_dsd(params_format(params));
-
-	ret = davinci_mcasp_mute_stream(cpu_dai, 1, substream->stream);
+	ret = davinci_mcasp_mute_stream(cpu_dai, 1, stream);
 	if (ret)
 		return ret;
 
@@ -1169,9 +2017,11 @@ static int davinci_mcasp_hw_params(struct snd_pcm_substream *substream,
 
 	/*
 	 * If mcasp is BCLK master, and a BCLK divider was not provided by
-	 * the machine driver, we need to calculate the ratio.
+	 * the machine driver, we need to calculate the ratio. The async RX
+	 * dividers are always set by the machine driver.
 	 */
-	if (mcasp->bclk_master && mcasp->bclk_div == 0 && mcasp->sysclk_freq) {
+	if (mcasp->bclk_master && mcasp->bclk_div == 0 && mcasp->sysclk_freq &&
+	    !davinci_mcasp_rx_async(mcasp, stream)) {
 		int slots = mcasp->tdm_slots;
 		int rate = params_rate(params);
 		int sbits = params_width(params);
@@ -1182,7 +2032,7 @@ static int davinci_mcasp_hw_params(struct snd_pcm_substream *substream,
 		davinci_mcasp_calc_clk_div(mcasp, rate * sbits * slots, true);
 	}
 
-	ret = mcasp_common_hw_param(mcasp, substream->stream,
+	ret = mcasp_common_hw_param(mcasp, stream,
 				    period_size * channels, channels);
 	if (ret)
 		return ret;
@@ -1190,60 +2040,80 @@ static int davinci_mcasp_hw_params(struct snd_pcm_substream *substream,
 	if (mcasp->op_mode == DAVINCI_MCASP_DIT_MODE)
 		ret = mcasp_dit_hw_param(mcasp, params_rate(params));
 	else
-		ret = mcasp_i2s_hw_param(mcasp, substream->stream, channels);
+		ret = mcasp_i2s_hw_param(mcasp, stream, channels);
 
 	if (ret)
 		return ret;
 
-	switch (params_format(params)) {
-	case SNDRV_PCM_FORMAT_U8:
-	case SNDRV_PCM_FORMAT_S8:
-		word_length = 8;
-		break;
-
-	case SNDRV_PCM_FORMAT_U16_LE:
-	case SNDRV_PCM_FORMAT_S16_LE:
-		word_length = 16;
-		break;
-
-	case SNDRV_PCM_FORMAT_U24_3LE:
-	case SNDRV_PCM_FORMAT_S24_3LE:
-		word_length = 24;
-		break;
-
-	case SNDRV_PCM_FORMAT_U24_LE:
-	case SNDRV_PCM_FORMAT_S24_LE:
-		word_length = 24;
-		break;
-
-	case SNDRV_PCM_FORMAT_U32_LE:
-	case SNDRV_PCM_FORMAT_S32_LE:
-		word_length = 32;
-		break;
+	if (mcasp->op_mode == DAVINCI_MCASP_IIS_MODE) {
+		ret = davinci_mcasp_clkchk_verify(mcasp, stream,
+						  params_rate(params));
+		if (ret)
+			return ret;
+	}
 
-	case SNDRV_PCM_FORMAT_DSD_U8:
-		word_length = 8;
-		break;
+	return davinci_config_channel_size(mcasp, word_length);
+}
 
-	case SNDRV_PCM_FORMAT_DSD_U16_LE:
-	case SNDRV_PCM_FORMAT_DSD_U16_BE:
-		word_length = 16;
-		break;
+static void davinci_mcasp_hw_stats_update(struct davinci_mcasp_hw_stats *stats,
+					  ktime_t start)
+{
+	stats->last_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	if (stats->last_ns > stats->max_ns)
+		stats->max_ns = stats->last_ns;
+	stats->count++;
+}
 
-	case SNDRV_PCM_FORMAT_DSD_U32_LE:
-	case SNDRV_PCM_FORMAT_DSD_U32_BE:
-		word_length = 32;
-		break;
+static int davinci_mcasp_hw_params(struct snd_pcm_substream *substream,
+					struct snd_pcm_hw_params *params,
+					struct snd_soc_dai *cpu_dai)
+{
+	struct davinci_mcasp *mcasp = snd_soc_dai_get_drvdata(cpu_dai);
+	struct davinci_mcasp_stream_state *state;
+	struct davinci_mcasp_hw_stats *stats;
+	int stream = substream->stream;
+	int channels = params_channels(params);
+	int period_size = params_period_size(params);
+	bool dsd = is_dsd(params_format(params));
+	ktime_t start = ktime_get();
+	int word_length;
+	int ret;
 
-	default:
+	word_length = davinci_mcasp_word_length(params_format(params));
+	if (word_length < 0) {
 		printk(KERN_WARNING "davinci-mcasp: unsupported PCM format");
 		return -EINVAL;
 	}
 
-	davinci_config_channel_size(mcasp, word_length);
+	state = &mcasp->stream_state[stream];
+	mcasp->dsd_mode[stream] = dsd;
+
+	if (davinci_mcasp_is_dsd_switch(mcasp, stream, dsd)) {
+		stats = &mcasp->hw_stats[MCASP_HW_PARAMS_DSD_SWITCH];
+		ret = davinci_mcasp_dsd_switch(cpu_dai, stream,
+					       period_size * channels,
+					       channels, word_length);
+	} else {
+		stats = &mcasp->hw_stats[MCASP_HW_PARAMS_FULL];
+		ret = __davinci_mcasp_hw_params(cpu_dai, params, stream,
+						word_length);
+	}
+
+	state->valid = !ret;
+	if (ret)
+		return ret;
+
+	state->dsd = dsd;
+	state->dai_fmt = mcasp->dai_fmt;
+	state->channels = channels;
 
-	if (mcasp->op_mode == DAVINCI_MCASP_IIS_MODE)
+	if (mcasp->op_mode == DAVINCI_MCASP_IIS_MODE) {
+		spin_lock_irq(&mcasp->lock);
 		mcasp->channels = channels;
+		spin_unlock_irq(&mcasp->lock);
+	}
+
+	davinci_mcasp_hw_stats_update(stats, start);
 
 	return 0;
 }
@@ -1258,7 +2128,7 @@ static int davinci_mcasp_trigger(struct snd_pcm_substream *substream,
 	case SNDRV_PCM_TRIGGER_RESUME:
 	case SNDRV_PCM_TRIGGER_START:
 	case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
-		davinci_mcasp_start(mcasp, substream->stream);
+		ret = davinci_mcasp_start(mcasp, substream->stream);
 		break;
 	case SNDRV_PCM_TRIGGER_SUSPEND:
 	case SNDRV_PCM_TRIGGER_STOP:
@@ -1275,11 +2145,50 @@ static int davinci_mcasp_trigger(struct snd_pcm_substream *substream,
 
 static const unsigned int davinci_mcasp_dai_rates[] = {
 	8000, 11025, 16000, 22050, 32000, 44100, 48000, 64000,
-	88200, 96000, 176400, 192000,
+	88200, 96000, 176400, 192000, 352800, 384000, 705600, 768000,
 };
 
 #define DAVINCI_MAX_RATE_ERROR_PPM 1000
 
+/*
+ * The BCLK dividers only depend on the sysclk, the AUXCLK divider being
+ * enabled and the number of tdm slots. Evaluate them once for every rate
+ * and slot width here instead of in every hw_refine pass.
+ */
+static void davinci_mcasp_update_rate_table(struct davinci_mcasp *mcasp)
+{
+	int sbits, i;
+
+	memset(mcasp->rate_mask, 0, sizeof(mcasp->rate_mask));
+
+	if (!mcasp->sysclk_freq)
+		return;
+
+	for (sbits = 8; sbits < ARRAY_SIZE(mcasp->rate_mask); sbits++) {
+		for (i = 0; i < ARRAY_SIZE(davinci_mcasp_dai_rates); i++) {
+			uint bclk_freq = sbits * mcasp->tdm_slots *
+				davinci_mcasp_dai_rates[i];
+			int ppm;
+
+			ppm = davinci_mcasp_calc_clk_div(mcasp, bclk_freq,
+							 false);
+			if (abs(ppm) < DAVINCI_MAX_RATE_ERROR_PPM)
+				mcasp->rate_mask[sbits] |= BIT(i);
+		}
+	}
+}
+
+static u32 davinci_mcasp_rate_mask(struct davinci_mcasp *mcasp, int sbits)
+{
+	if (mcasp->slot_width)
+		sbits = mcasp->slot_width;
+
+	if (sbits < 0 || sbits >= ARRAY_SIZE(mcasp->rate_mask))
+		return 0;
+
+	return mcasp->rate_mask[sbits];
+}
+
 static int davinci_mcasp_hw_rule_rate(struct snd_pcm_hw_params *params,
 				      struct snd_pcm_hw_rule *rule)
 {
@@ -1287,37 +2196,28 @@ static int davinci_mcasp_hw_rule_rate(struct snd_pcm_hw_params *params,
 	struct snd_interval *ri =
 		hw_param_interval(params, SNDRV_PCM_HW_PARAM_RATE);
 	int sbits = params_width(params);
-	int slots = rd->mcasp->tdm_slots;
+	u32 mask = davinci_mcasp_rate_mask(rd->mcasp, sbits);
 	struct snd_interval range;
 	int i;
 
-	if (rd->mcasp->slot_width)
-		sbits = rd->mcasp->slot_width;
-
 	snd_interval_any(&range);
 	range.empty = 1;
 
 	for (i = 0; i < ARRAY_SIZE(davinci_mcasp_dai_rates); i++) {
-		if (snd_interval_test(ri, davinci_mcasp_dai_rates[i])) {
-			uint bclk_freq = sbits*slots*
-				davinci_mcasp_dai_rates[i];
-			int ppm;
-
-			ppm = davinci_mcasp_calc_clk_div(rd->mcasp, bclk_freq,
-							 false);
-			if (abs(ppm) < DAVINCI_MAX_RATE_ERROR_PPM) {
-				if (range.empty) {
-					range.min = davinci_mcasp_dai_rates[i];
-					range.empty = 0;
-				}
-				range.max = davinci_mcasp_dai_rates[i];
+		if ((mask & BIT(i)) &&
+		    snd_interval_test(ri, davinci_mcasp_dai_rates[i])) {
+			if (range.empty) {
+				range.min = davinci_mcasp_dai_rates[i];
+				range.empty = 0;
 			}
+			range.max = davinci_mcasp_dai_rates[i];
 		}
 	}
 
 	dev_dbg(rd->mcasp->dev,
 		"Frequencies %d-%d -> %d-%d for %d sbits and %d tdm slots\n",
-		ri->min, ri->max, range.min, range.max, sbits, slots);
+		ri->min, ri->max, range.min, range.max, sbits,
+		rd->mcasp->tdm_slots);
 
 	return snd_interval_refine(hw_param_interval(params, rule->var),
 				   &range);
@@ -1331,22 +2231,33 @@ static int davinci_mcasp_hw_rule_format(struct snd_pcm_hw_params *params,
 	struct snd_mask nfmt;
 	int rate = params_rate(params);
 	int slots = rd->mcasp->tdm_slots;
-	int i, count = 0;
+	int i, rate_idx, count = 0;
+
+	for (rate_idx = 0; rate_idx < ARRAY_SIZE(davinci_mcasp_dai_rates);
+	     rate_idx++)
+		if (davinci_mcasp_dai_rates[rate_idx] == rate)
+			break;
 
 	snd_mask_none(&nfmt);
 
 	for (i = 0; i < SNDRV_PCM_FORMAT_LAST; i++) {
 		if (snd_mask_test(fmt, i)) {
-			uint sbits = snd_pcm_format_width(i);
-			int ppm;
+			int sbits = snd_pcm_format_width(i);
+			bool ok;
 
-			if (rd->mcasp->slot_width)
-				sbits = rd->mcasp->slot_width;
+			if (rate_idx < ARRAY_SIZE(davinci_mcasp_dai_rates)) {
+				ok = davinci_mcasp_rate_mask(rd->mcasp, sbits) &
+				     BIT(rate_idx);
+			} else {
+				/* not a listed rate, calculate it */
+				if (rd->mcasp->slot_width)
+					sbits = rd->mcasp->slot_width;
+				ok = abs(davinci_mcasp_calc_clk_div(rd->mcasp,
+						sbits * slots * rate, false)) <
+				     DAVINCI_MAX_RATE_ERROR_PPM;
+			}
 
-			ppm = davinci_mcasp_calc_clk_div(rd->mcasp,
-							 sbits * slots * rate,
-							 false);
-			if (abs(ppm) < DAVINCI_MAX_RATE_ERROR_PPM) {
+			if (ok) {
 				snd_mask_set(&nfmt, i);
 				count++;
 			}
@@ -1417,15 +2328,22 @@ static int davinci_mcasp_startup(struct snd_pcm_substream *substream,
 	struct davinci_mcasp *mcasp = snd_soc_dai_get_drvdata(cpu_dai);
 	struct davinci_mcasp_ruledata *ruledata =
 					&mcasp->ruledata[substream->stream];
+	bool rx_async = davinci_mcasp_rx_async(mcasp, substream->stream);
 	u32 max_channels = 0;
+	u32 active_channels;
 	int i, dir;
 	int tdm_slots = mcasp->tdm_slots;
 
 	/* Do not allow more then one stream per direction */
-	if (mcasp->substreams[substream->stream])
+	spin_lock_irq(&mcasp->lock);
+	if (mcasp->substreams[substream->stream] || mcasp->loopback_running) {
+		spin_unlock_irq(&mcasp->lock);
 		return -EBUSY;
+	}
 
 	mcasp->substreams[substream->stream] = substream;
+	active_channels = mcasp->channels;
+	spin_unlock_irq(&mcasp->lock);
 
 	if (mcasp->tdm_mask[substream->stream])
 		tdm_slots = hweight32(mcasp->tdm_mask[substream->stream]);
@@ -1453,10 +2371,10 @@ static int davinci_mcasp_startup(struct snd_pcm_substream *substream,
 	 * limnit based on the seirializers * tdm_slots, we need to use that as
 	 * a constraint for the second stream.
 	 * Otherwise (first stream or less allowed channels) we use the
-	 * calculated constraint.
+	 * calculated constraint. The async RX has a frame of its own.
 	 */
-	if (mcasp->channels && mcasp->channels < max_channels)
-		max_channels = mcasp->channels;
+	if (!rx_async && active_channels && active_channels < max_channels)
+		max_channels = active_channels;
 	/*
 	 * But we can always allow channels upto the amount of
 	 * the available tdm_slots.
@@ -1477,11 +2395,27 @@ static int davinci_mcasp_startup(struct snd_pcm_substream *substream,
 					     SNDRV_PCM_HW_PARAM_SAMPLE_BITS,
 					     8, mcasp->slot_width);
 
+	/*
+	 * The streams share the clocks unless RX is async. The DAI is not
+	 * flagged symmetric as the ASoC core would apply that to the async
+	 * RX too.
+	 */
+	if (!mcasp->rx_async && cpu_dai->rate)
+		snd_pcm_hw_constraint_minmax(substream->runtime,
+					     SNDRV_PCM_HW_PARAM_RATE,
+					     cpu_dai->rate, cpu_dai->rate);
+	if (!mcasp->rx_async && cpu_dai->sample_bits)
+		snd_pcm_hw_constraint_minmax(substream->runtime,
+					     SNDRV_PCM_HW_PARAM_SAMPLE_BITS,
+					     cpu_dai->sample_bits,
+					     cpu_dai->sample_bits);
+
 	/*
 	 * If we rely on implicit BCLK divider setting we should
 	 * set constraints based on what we can provide.
 	 */
-	if (mcasp->bclk_master && mcasp->bclk_div == 0 && mcasp->sysclk_freq) {
+	if (mcasp->bclk_master && mcasp->bclk_div == 0 && mcasp->sysclk_freq &&
+	    !rx_async) {
 		int ret;
 
 		ruledata->mcasp = mcasp;
@@ -1510,13 +2444,12 @@ static void davinci_mcasp_shutdown(struct snd_pcm_substream *substream,
 {
 	struct davinci_mcasp *mcasp = snd_soc_dai_get_drvdata(cpu_dai);
 
+	spin_lock_irq(&mcasp->lock);
 	mcasp->substreams[substream->stream] = NULL;
 
-	if (mcasp->op_mode == DAVINCI_MCASP_DIT_MODE)
-		return;
-
-	if (!cpu_dai->active)
+	if (mcasp->op_mode != DAVINCI_MCASP_DIT_MODE && !cpu_dai->active)
 		mcasp->channels = 0;
+	spin_unlock_irq(&mcasp->lock);
 }
 
 static int davinci_mcasp_mute_stream(struct snd_soc_dai *cpu_dai,
@@ -1543,10 +2476,37 @@ static int davinci_mcasp_mute_stream(struct snd_soc_dai *cpu_dai,
 	return 0;
 }
 
+/*
+ * Frames between the DMA position and the pins: the words waiting in the
+ * AFIFO plus XBUF and the shift register of every active serializer.
+ */
+static snd_pcm_sframes_t davinci_mcasp_delay(
+			struct snd_pcm_substream *substream,
+			struct snd_soc_dai *cpu_dai)
+{
+	struct davinci_mcasp *mcasp = snd_soc_dai_get_drvdata(cpu_dai);
+	int stream = substream->stream;
+	unsigned int channels = substream->runtime->channels;
+	u32 words = 2 * mcasp->active_serializers[stream];
+	u32 reg;
+
+	if (mcasp->afifo_numevt[stream]) {
+		if (stream == SNDRV_PCM_STREAM_PLAYBACK)
+			reg = mcasp->fifo_base + MCASP_WFIFOSTS_OFFSET;
+		else
+			reg = mcasp->fifo_base + MCASP_RFIFOSTS_OFFSET;
+
+		words += mcasp_get_reg(mcasp, reg) & FIFO_LVL_MASK;
+	}
+
+	return channels ? words / channels : 0;
+}
+
 static const struct snd_soc_dai_ops davinci_mcasp_dai_ops = {
 	.startup	= davinci_mcasp_startup,
 	.shutdown	= davinci_mcasp_shutdown,
 	.trigger	= davinci_mcasp_trigger,
+	.delay		= davinci_mcasp_delay,
 	.hw_params	= davinci_mcasp_hw_params,
 	.set_fmt	= davinci_mcasp_set_dai_fmt,
 	.set_clkdiv	= davinci_mcasp_set_clkdiv,
@@ -1556,6 +2516,53 @@ static const struct snd_soc_dai_ops davinci_mcasp_dai_ops = {
 	.mute_stream = davinci_mcasp_mute_stream,
 };
 
+static int davinci_mcasp_xrun_info(struct snd_kcontrol *kcontrol,
+				   struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = MCASP_XRUN_NUM;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = INT_MAX;
+
+	return 0;
+}
+
+static int davinci_mcasp_xrun_get(struct snd_kcontrol *kcontrol,
+				  struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_soc_dai *dai = snd_kcontrol_chip(kcontrol);
+	struct davinci_mcasp *mcasp = snd_soc_dai_get_drvdata(dai);
+	atomic_t *count = mcasp->xrun_count[kcontrol->private_value];
+	int i;
+
+	for (i = 0; i < MCASP_XRUN_NUM; i++)
+		ucontrol->value.integer.value[i] = atomic_read(&count[i]);
+
+	return 0;
+}
+
+/* Values: FIFO underrun/overrun, XRERR, unhandled events */
+static const struct snd_kcontrol_new davinci_mcasp_xrun_controls[] = {
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+		.name = "McASP Playback XRUN Count",
+		.access = SNDRV_CTL_ELEM_ACCESS_READ |
+			  SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+		.info = davinci_mcasp_xrun_info,
+		.get = davinci_mcasp_xrun_get,
+		.private_value = SNDRV_PCM_STREAM_PLAYBACK,
+	},
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+		.name = "McASP Capture XRUN Count",
+		.access = SNDRV_CTL_ELEM_ACCESS_READ |
+			  SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+		.info = davinci_mcasp_xrun_info,
+		.get = davinci_mcasp_xrun_get,
+		.private_value = SNDRV_PCM_STREAM_CAPTURE,
+	},
+};
+
 static int davinci_mcasp_dai_probe(struct snd_soc_dai *dai)
 {
 	struct davinci_mcasp *mcasp = snd_soc_dai_get_drvdata(dai);
@@ -1563,6 +2570,11 @@ static int davinci_mcasp_dai_probe(struct snd_soc_dai *dai)
 	dai->playback_dma_data = &mcasp->dma_data[SNDRV_PCM_STREAM_PLAYBACK];
 	dai->capture_dma_data = &mcasp->dma_data[SNDRV_PCM_STREAM_CAPTURE];
 
+	if (xrun_controls)
+		return snd_soc_add_dai_controls(dai,
+				davinci_mcasp_xrun_controls,
+				ARRAY_SIZE(davinci_mcasp_xrun_controls));
+
 	return 0;
 }
 
@@ -1571,28 +2583,14 @@ static int davinci_mcasp_suspend(struct snd_soc_dai *dai)
 {
 	struct davinci_mcasp *mcasp = snd_soc_dai_get_drvdata(dai);
 	struct davinci_mcasp_context *context = &mcasp->context;
-	u32 reg;
-	int i;
 
 	context->pm_state = pm_runtime_active(mcasp->dev);
 	if (!context->pm_state)
 		pm_runtime_get_sync(mcasp->dev);
 
-	for (i = 0; i < ARRAY_SIZE(context_regs); i++)
-		context->config_regs[i] = mcasp_get_reg(mcasp, context_regs[i]);
-
-	if (mcasp->txnumevt) {
-		reg = mcasp->fifo_base + MCASP_WFIFOCTL_OFFSET;
-		context->afifo_regs[0] = mcasp_get_reg(mcasp, reg);
-	}
-	if (mcasp->rxnumevt) {
-		reg = mcasp->fifo_base + MCASP_RFIFOCTL_OFFSET;
-		context->afifo_regs[1] = mcasp_get_reg(mcasp, reg);
-	}
-
-	for (i = 0; i < mcasp->num_serializer; i++)
-		context->xrsr_regs[i] = mcasp_get_reg(mcasp,
-						DAVINCI_MCASP_XRSRCTL_REG(i));
+	/* the register cache keeps the configuration while powered down */
+	regcache_cache_only(mcasp->regmap, true);
+	regcache_mark_dirty(mcasp->regmap);
 
 	pm_runtime_put_sync(mcasp->dev);
 
@@ -1602,32 +2600,20 @@ static int davinci_mcasp_suspend(struct snd_soc_dai *dai)
 static int davinci_mcasp_resume(struct snd_soc_dai *dai)
 {
 	struct davinci_mcasp *mcasp = snd_soc_dai_get_drvdata(dai);
-	struct davinci_mcasp_context *context = &mcasp->context;
-	u32 reg;
-	int i;
+	struct davinci_mcasp_context *context = &mcasp->context;
+	int ret;
 
 	pm_runtime_get_sync(mcasp->dev);
 
-	for (i = 0; i < ARRAY_SIZE(context_regs); i++)
-		mcasp_set_reg(mcasp, context_regs[i], context->config_regs[i]);
-
-	if (mcasp->txnumevt) {
-		reg = mcasp->fifo_base + MCASP_WFIFOCTL_OFFSET;
-		mcasp_set_reg(mcasp, reg, context->afifo_regs[0]);
-	}
-	if (mcasp->rxnumevt) {
-		reg = mcasp->fifo_base + MCASP_RFIFOCTL_OFFSET;
-		mcasp_set_reg(mcasp, reg, context->afifo_regs[1]);
-	}
-
-	for (i = 0; i < mcasp->num_serializer; i++)
-		mcasp_set_reg(mcasp, DAVINCI_MCASP_XRSRCTL_REG(i),
-			      context->xrsr_regs[i]);
+	regcache_cache_only(mcasp->regmap, false);
+	ret = regcache_sync(mcasp->regmap);
+	if (ret)
+		dev_err(mcasp->dev, "failed to restore registers: %d\n", ret);
 
 	if (!context->pm_state)
 		pm_runtime_put_sync(mcasp->dev);
 
-	return 0;
+	return ret;
 }
 #else
 #define davinci_mcasp_suspend NULL
@@ -1669,9 +2655,6 @@ static struct snd_soc_dai_driver davinci_mcasp_dai[] = {
 			.formats	= DAVINCI_MCASP_PCM_FMTS,
 		},
 		.ops 		= &davinci_mcasp_dai_ops,
-
-		.symmetric_samplebits	= 1,
-		.symmetric_rates	= 1,
 	},
 	{
 		.name		= "davinci-mcasp.1",
@@ -1738,6 +2721,21 @@ static const struct of_device_id mcasp_dt_ids[] = {
 };
 MODULE_DEVICE_TABLE(of, mcasp_dt_ids);
 
+/* The functional clock rate is the reference of the clock check */
+static void davinci_mcasp_get_fclk_rate(struct davinci_mcasp *mcasp)
+{
+	struct clk *fclk;
+
+	fclk = clk_get(mcasp->dev, "fck");
+	if (IS_ERR(fclk)) {
+		dev_info(mcasp->dev, "no fck, clock check disabled\n");
+		return;
+	}
+
+	mcasp->fclk_rate = clk_get_rate(fclk);
+	clk_put(fclk);
+}
+
 static int mcasp_reparent_fck(struct platform_device *pdev)
 {
 	struct device_node *node = pdev->dev.of_node;
@@ -1909,6 +2907,597 @@ nodata:
 	return  pdata;
 }
 
+static ssize_t davinci_mcasp_afifo_policy_show(struct davinci_mcasp *mcasp,
+					       int stream, char *buf)
+{
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(davinci_mcasp_afifo_policies); i++) {
+		if (i == mcasp->afifo_policy[stream])
+			len += sprintf(buf + len, "[%s] ",
+				       davinci_mcasp_afifo_policies[i]);
+		else
+			len += sprintf(buf + len, "%s ",
+				       davinci_mcasp_afifo_policies[i]);
+	}
+	buf[len - 1] = '\n';
+
+	return len;
+}
+
+static ssize_t davinci_mcasp_afifo_policy_store(struct davinci_mcasp *mcasp,
+						int stream, const char *buf,
+						size_t count)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(davinci_mcasp_afifo_policies); i++) {
+		if (sysfs_streq(buf, davinci_mcasp_afifo_policies[i])) {
+			/* applied by the next hw_params of the stream */
+			mcasp->afifo_policy[stream] = i;
+			return count;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static ssize_t afifo_policy_playback_show(struct device *dev,
+					  struct device_attribute *attr,
+					  char *buf)
+{
+	return davinci_mcasp_afifo_policy_show(dev_get_drvdata(dev),
+					       SNDRV_PCM_STREAM_PLAYBACK, buf);
+}
+
+static ssize_t afifo_policy_playback_store(struct device *dev,
+					   struct device_attribute *attr,
+					   const char *buf, size_t count)
+{
+	return davinci_mcasp_afifo_policy_store(dev_get_drvdata(dev),
+						SNDRV_PCM_STREAM_PLAYBACK,
+						buf, count);
+}
+
+static ssize_t afifo_policy_capture_show(struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	return davinci_mcasp_afifo_policy_show(dev_get_drvdata(dev),
+					       SNDRV_PCM_STREAM_CAPTURE, buf);
+}
+
+static ssize_t afifo_policy_capture_store(struct device *dev,
+					  struct device_attribute *attr,
+					  const char *buf, size_t count)
+{
+	return davinci_mcasp_afifo_policy_store(dev_get_drvdata(dev),
+						SNDRV_PCM_STREAM_CAPTURE,
+						buf, count);
+}
+
+static DEVICE_ATTR_RW(afifo_policy_playback);
+static DEVICE_ATTR_RW(afifo_policy_capture);
+
+static struct attribute *davinci_mcasp_attrs[] = {
+	&dev_attr_afifo_policy_playback.attr,
+	&dev_attr_afifo_policy_capture.attr,
+	NULL,
+};
+
+ATTRIBUTE_GROUPS(davinci_mcasp);
+
+#ifdef CONFIG_DEBUG_FS
+static int davinci_mcasp_afifo_show(struct seq_file *s, void *unused)
+{
+	struct davinci_mcasp *mcasp = s->private;
+	static const char * const names[] = { "playback", "capture" };
+	int stream;
+
+	for (stream = 0; stream < ARRAY_SIZE(names); stream++)
+		seq_printf(s, "%s: policy %s, numevt %d, maxburst %u\n",
+			   names[stream],
+			   davinci_mcasp_afifo_policies[mcasp->afifo_policy[stream]],
+			   mcasp->afifo_numevt[stream],
+			   mcasp->dma_data[stream].maxburst);
+
+	return 0;
+}
+
+static int davinci_mcasp_afifo_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, davinci_mcasp_afifo_show, inode->i_private);
+}
+
+static const struct file_operations davinci_mcasp_afifo_fops = {
+	.open		= davinci_mcasp_afifo_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int davinci_mcasp_hw_params_show(struct seq_file *s, void *unused)
+{
+	struct davinci_mcasp *mcasp = s->private;
+	static const char * const names[] = {
+		[MCASP_HW_PARAMS_FULL] = "full",
+		[MCASP_HW_PARAMS_DSD_SWITCH] = "dsd switch",
+	};
+	int i;
+
+	for (i = 0; i < MCASP_HW_PARAMS_NUM; i++)
+		seq_printf(s, "%s: count %u, last %llu ns, max %llu ns\n",
+			   names[i], mcasp->hw_stats[i].count,
+			   mcasp->hw_stats[i].last_ns,
+			   mcasp->hw_stats[i].max_ns);
+
+	return 0;
+}
+
+static int davinci_mcasp_hw_params_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, davinci_mcasp_hw_params_show,
+			   inode->i_private);
+}
+
+static const struct file_operations davinci_mcasp_hw_params_fops = {
+	.open		= davinci_mcasp_hw_params_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * One DMA request feeds all active serializers of a direction, a frame
+ * in the buffer holds slot 0 of every serializer, then slot 1 and so on.
+ * Show which pin and slot each channel of the last hw_params ends up on,
+ * e.g. to set up the bindings of the ALSA dshare plugin.
+ */
+static int davinci_mcasp_channels_show(struct seq_file *s, void *unused)
+{
+	struct davinci_mcasp *mcasp = s->private;
+	static const char * const names[] = { "playback", "capture" };
+	static const u8 dirs[] = { TX_MODE, RX_MODE };
+	u8 axr[32];
+	int stream, i, n;
+
+	for (stream = 0; stream < ARRAY_SIZE(names); stream++) {
+		struct davinci_mcasp_stream_state *state =
+						&mcasp->stream_state[stream];
+		int active = mcasp->active_serializers[stream];
+
+		if (!state->valid || active <= 0)
+			continue;
+
+		n = 0;
+		for (i = 0; i < mcasp->num_serializer && n < active; i++)
+			if (mcasp->serial_dir[i] == dirs[stream])
+				axr[n++] = i;
+		if (n < active)
+			continue;
+
+		seq_printf(s, "%s: %d channels on %d serializers%s\n",
+			   names[stream], state->channels, active,
+			   state->dsd ? " (DSD)" : "");
+		for (i = 0; i < state->channels; i++)
+			seq_printf(s, "  ch%d: AXR%u slot %d\n", i,
+				   axr[i % active], i / active);
+	}
+
+	return 0;
+}
+
+static int davinci_mcasp_channels_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, davinci_mcasp_channels_show,
+			   inode->i_private);
+}
+
+static const struct file_operations davinci_mcasp_channels_fops = {
+	.open		= davinci_mcasp_channels_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int davinci_mcasp_clkchk_show(struct seq_file *s, void *unused)
+{
+	struct davinci_mcasp *mcasp = s->private;
+	static const char * const names[] = { "tx", "rx" };
+	int stream;
+
+	if (!mcasp->fclk_rate) {
+		seq_puts(s, "disabled\n");
+		return 0;
+	}
+
+	seq_printf(s, "fclk %lu Hz, strict %s\n", mcasp->fclk_rate,
+		   clkchk_strict ? "yes" : "no");
+	for (stream = 0; stream < ARRAY_SIZE(names); stream++) {
+		struct davinci_mcasp_clkchk *chk = &mcasp->clkchk[stream];
+
+		seq_printf(s, "%s: %u Hz (count %u), samples %u, loss %u, change %u, mismatch %u\n",
+			   names[stream], chk->freq, chk->count, chk->samples,
+			   chk->loss, chk->change, chk->mismatch);
+	}
+
+	return 0;
+}
+
+static int davinci_mcasp_clkchk_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, davinci_mcasp_clkchk_show, inode->i_private);
+}
+
+static const struct file_operations davinci_mcasp_clkchk_fops = {
+	.open		= davinci_mcasp_clkchk_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int davinci_mcasp_tx_start_show(struct seq_file *s, void *unused)
+{
+	struct davinci_mcasp *mcasp = s->private;
+	struct davinci_mcasp_tx_start_stats *stats = &mcasp->tx_start_stats;
+	u64 avg = 0;
+
+	if (stats->count)
+		avg = div_u64(stats->total_ns, stats->count);
+
+	seq_printf(s, "count %u, timeouts %u\n", stats->count, stats->timeouts);
+	seq_printf(s, "min %llu ns, avg %llu ns, max %llu ns\n",
+		   stats->min_ns, avg, stats->max_ns);
+
+	return 0;
+}
+
+static int davinci_mcasp_tx_start_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, davinci_mcasp_tx_start_show,
+			   inode->i_private);
+}
+
+static ssize_t davinci_mcasp_tx_start_write(struct file *file,
+					    const char __user *buf,
+					    size_t count, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct davinci_mcasp *mcasp = s->private;
+
+	/* any write resets the statistics */
+	memset(&mcasp->tx_start_stats, 0, sizeof(mcasp->tx_start_stats));
+
+	return count;
+}
+
+static int davinci_mcasp_xrun_show(struct seq_file *s, void *unused)
+{
+	struct davinci_mcasp *mcasp = s->private;
+	static const char * const names[] = { "playback", "capture" };
+	struct davinci_mcasp_xrun_event ev;
+	unsigned int seq, first, i;
+	int stream;
+
+	for (stream = 0; stream < ARRAY_SIZE(names); stream++) {
+		atomic_t *count = mcasp->xrun_count[stream];
+
+		seq_printf(s, "%s: %s %d, xrerr %d, unhandled %d\n",
+			   names[stream],
+			   stream == SNDRV_PCM_STREAM_PLAYBACK ?
+			   "underrun" : "overrun",
+			   atomic_read(&count[MCASP_XRUN_FIFO]),
+			   atomic_read(&count[MCASP_XRUN_XRERR]),
+			   atomic_read(&count[MCASP_XRUN_UNHANDLED]));
+	}
+
+	seq = atomic_read(&mcasp->xrun_seq);
+	first = seq > MCASP_XRUN_LOG_SIZE ? seq - MCASP_XRUN_LOG_SIZE + 1 : 1;
+
+	for (i = first; i <= seq; i++) {
+		struct davinci_mcasp_xrun_event *slot =
+			&mcasp->xrun_log[(i - 1) & (MCASP_XRUN_LOG_SIZE - 1)];
+
+		if (READ_ONCE(slot->seq) != i)
+			continue;
+		smp_rmb();
+		ev = *slot;
+		smp_rmb();
+		/* overwritten while copying */
+		if (READ_ONCE(slot->seq) != i)
+			continue;
+
+		seq_printf(s, "#%u %lld ns %s stat 0x%08x fifo %u pos %lu/%lu",
+			   i, ktime_to_ns(ev.time), names[ev.stream], ev.stat,
+			   ev.fifo_level, ev.position, ev.buffer_size);
+		if (ev.rate)
+			seq_printf(s, " residue %zd bytes %u Hz %s %u ch",
+				   snd_pcm_format_size(ev.format,
+					(ev.buffer_size - ev.position) *
+					ev.channels),
+				   ev.rate, snd_pcm_format_name(ev.format),
+				   ev.channels);
+		seq_puts(s, "\n");
+	}
+
+	return 0;
+}
+
+static int davinci_mcasp_xrun_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, davinci_mcasp_xrun_show, inode->i_private);
+}
+
+static const struct file_operations davinci_mcasp_xrun_fops = {
+	.open		= davinci_mcasp_xrun_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+#define MCASP_LOOPBACK_WORDS		8
+#define MCASP_LOOPBACK_TIMEOUT_US	10000
+
+/* pins released during the loopback test, nothing is driven to the DAC */
+#define MCASP_LOOPBACK_PINS	(AXR(0) | AXR(1) | ACLKX | AHCLKX | AFSX | \
+				 ACLKR | AHCLKR | AFSR)
+
+/* registers changed by the loopback test, restored from the cache */
+static const unsigned int davinci_mcasp_loopback_regs[] = {
+	/* function before direction: no GPIO drives the pins on restore */
+	DAVINCI_MCASP_PFUNC_REG,
+	DAVINCI_MCASP_PDIR_REG,
+	DAVINCI_MCASP_LBCTL_REG,
+	DAVINCI_MCASP_TXFMT_REG,
+	DAVINCI_MCASP_RXFMT_REG,
+	DAVINCI_MCASP_TXMASK_REG,
+	DAVINCI_MCASP_RXMASK_REG,
+	DAVINCI_MCASP_TXFMCTL_REG,
+	DAVINCI_MCASP_ACLKXCTL_REG,
+	DAVINCI_MCASP_AHCLKXCTL_REG,
+	DAVINCI_MCASP_TXTDM_REG,
+	DAVINCI_MCASP_RXTDM_REG,
+	DAVINCI_MCASP_XRSRCTL_REG(0),
+	DAVINCI_MCASP_XRSRCTL_REG(1),
+};
+
+/*
+ * Send a pattern through serializer 0 and receive it on serializer 1
+ * through the internal loopback, both with the serializer format hw_params
+ * uses for the sample format. The pattern comes back unchanged if the
+ * samples are on the wire MSB first and aligned as the receiver expects.
+ */
+static int davinci_mcasp_loopback_format(struct davinci_mcasp *mcasp,
+					 const struct davinci_mcasp_format *f,
+					 u32 pattern, u32 *received)
+{
+	struct davinci_mcasp_slot_fmt sf;
+	ktime_t timeout;
+	int words = 0;
+	u32 stat;
+
+	davinci_mcasp_slot_fmt(mcasp, f->width, &sf);
+
+	regmap_write(mcasp->regmap, DAVINCI_MCASP_GBLCTL_REG, 0);
+
+	regmap_write(mcasp->regmap, DAVINCI_MCASP_TXFMT_REG,
+		     TXSSZ(sf.ssz) | TXROT(sf.tx_rotate) | TXORD | TXSEL |
+		     FSXDLY(1));
+	regmap_write(mcasp->regmap, DAVINCI_MCASP_RXFMT_REG,
+		     RXSSZ(sf.ssz) | RXROT(sf.rx_rotate) | RXORD | RXSEL |
+		     FSRDLY(1));
+	regmap_write(mcasp->regmap, DAVINCI_MCASP_TXMASK_REG, sf.mask);
+	regmap_write(mcasp->regmap, DAVINCI_MCASP_RXMASK_REG, sf.mask);
+	regmap_write(mcasp->regmap, DAVINCI_MCASP_TXTDM_REG, 0x3);
+	regmap_write(mcasp->regmap, DAVINCI_MCASP_RXTDM_REG, 0x3);
+	/* two slot frames, internal frame sync and clocks from AUXCLK */
+	regmap_write(mcasp->regmap, DAVINCI_MCASP_TXFMCTL_REG,
+		     FSXMOD(2) | FSXDUR | AFSXE);
+	regmap_write(mcasp->regmap, DAVINCI_MCASP_AHCLKXCTL_REG,
+		     AHCLKXE | AHCLKXDIV(1));
+	regmap_write(mcasp->regmap, DAVINCI_MCASP_ACLKXCTL_REG,
+		     ACLKXE | ACLKXDIV(7));
+	regmap_write(mcasp->regmap, DAVINCI_MCASP_XRSRCTL_REG(0), TX_MODE);
+	regmap_write(mcasp->regmap, DAVINCI_MCASP_XRSRCTL_REG(1), RX_MODE);
+	/* even serializers transmit to odd ones, TX generators for both */
+	regmap_write(mcasp->regmap, DAVINCI_MCASP_LBCTL_REG,
+		     LBEN | LBORD | LBGENMODE(1));
+
+	regmap_write(mcasp->regmap, DAVINCI_MCASP_TXSTAT_REG, 0xFFFFFFFF);
+	regmap_write(mcasp->regmap, DAVINCI_MCASP_RXSTAT_REG, 0xFFFFFFFF);
+
+	regmap_update_bits(mcasp->regmap, DAVINCI_MCASP_GBLCTL_REG,
+			   TXHCLKRST | TXCLKRST | RXHCLKRST | RXCLKRST,
+			   TXHCLKRST | TXCLKRST | RXHCLKRST | RXCLKRST);
+	regmap_update_bits(mcasp->regmap, DAVINCI_MCASP_GBLCTL_REG,
+			   TXSERCLR | RXSERCLR, TXSERCLR | RXSERCLR);
+	/* the data registers are not in the register map */
+	__raw_writel(pattern, mcasp->base + DAVINCI_MCASP_TXBUF_REG(0));
+	regmap_update_bits(mcasp->regmap, DAVINCI_MCASP_GBLCTL_REG,
+			   TXSMRST | RXSMRST, TXSMRST | RXSMRST);
+	regmap_update_bits(mcasp->regmap, DAVINCI_MCASP_GBLCTL_REG,
+			   TXFSRST | RXFSRST, TXFSRST | RXFSRST);
+
+	/* keep the transmitter fed, the first received words are stale */
+	timeout = ktime_add_us(ktime_get(), MCASP_LOOPBACK_TIMEOUT_US);
+	while (words < MCASP_LOOPBACK_WORDS) {
+		if (ktime_after(ktime_get(), timeout))
+			break;
+
+		regmap_read(mcasp->regmap, DAVINCI_MCASP_TXSTAT_REG, &stat);
+		if (stat & XRDATA)
+			__raw_writel(pattern,
+				     mcasp->base + DAVINCI_MCASP_TXBUF_REG(0));
+
+		regmap_read(mcasp->regmap, DAVINCI_MCASP_RXSTAT_REG, &stat);
+		if (stat & XRDATA) {
+			*received = __raw_readl(mcasp->base +
+						DAVINCI_MCASP_RXBUF_REG(1));
+			words++;
+		}
+	}
+
+	regmap_write(mcasp->regmap, DAVINCI_MCASP_GBLCTL_REG, 0);
+
+	if (words < MCASP_LOOPBACK_WORDS)
+		return -ETIMEDOUT;
+
+	*received &= sf.mask;
+	return 0;
+}
+
+static int davinci_mcasp_loopback_show(struct seq_file *s, void *unused)
+{
+	struct davinci_mcasp *mcasp = s->private;
+	static const snd_pcm_format_t unsupported[] = {
+		SNDRV_PCM_FORMAT_DSD_U16_BE,
+		SNDRV_PCM_FORMAT_DSD_U32_BE,
+	};
+	u32 saved[ARRAY_SIZE(davinci_mcasp_loopback_regs)];
+	u32 fifo_ctl[2];
+	int i, ret;
+
+	/* the receiver has no DIT mode */
+	if (mcasp->num_serializer < 2 ||
+	    mcasp->op_mode == DAVINCI_MCASP_DIT_MODE)
+		return -ENODEV;
+
+	/* no stream may start and no clock change while the test runs */
+	spin_lock_irq(&mcasp->lock);
+	if (mcasp->substreams[SNDRV_PCM_STREAM_PLAYBACK] ||
+	    mcasp->substreams[SNDRV_PCM_STREAM_CAPTURE] ||
+	    mcasp->sysclk_changes || mcasp->loopback_running) {
+		spin_unlock_irq(&mcasp->lock);
+		return -EBUSY;
+	}
+	mcasp->loopback_running = true;
+	spin_unlock_irq(&mcasp->lock);
+
+	pm_runtime_get_sync(mcasp->dev);
+
+	for (i = 0; i < ARRAY_SIZE(davinci_mcasp_loopback_regs); i++)
+		saved[i] = mcasp_get_reg(mcasp,
+					 davinci_mcasp_loopback_regs[i]);
+	fifo_ctl[0] = mcasp_get_reg(mcasp,
+				    mcasp->fifo_base + MCASP_WFIFOCTL_OFFSET);
+	fifo_ctl[1] = mcasp_get_reg(mcasp,
+				    mcasp->fifo_base + MCASP_RFIFOCTL_OFFSET);
+
+	/* the test does not touch the cache, it is used for the restore */
+	regcache_cache_bypass(mcasp->regmap, true);
+
+	/* inputs first, then GPIO: the pins are not driven at any time */
+	regmap_update_bits(mcasp->regmap, DAVINCI_MCASP_PDIR_REG,
+			   MCASP_LOOPBACK_PINS, 0);
+	regmap_update_bits(mcasp->regmap, DAVINCI_MCASP_PFUNC_REG,
+			   MCASP_LOOPBACK_PINS, MCASP_LOOPBACK_PINS);
+
+	regmap_update_bits(mcasp->regmap,
+			   mcasp->fifo_base + MCASP_WFIFOCTL_OFFSET,
+			   FIFO_ENABLE, 0);
+	regmap_update_bits(mcasp->regmap,
+			   mcasp->fifo_base + MCASP_RFIFOCTL_OFFSET,
+			   FIFO_ENABLE, 0);
+
+	for (i = 0; i < ARRAY_SIZE(davinci_mcasp_formats); i++) {
+		const struct davinci_mcasp_format *f = &davinci_mcasp_formats[i];
+		u32 pattern = 0x1e2d3c4b & ((1ULL << f->width) - 1);
+		u32 received = 0;
+
+		ret = davinci_mcasp_loopback_format(mcasp, f, pattern,
+						    &received);
+		seq_printf(s, "%-12s sent 0x%08x received 0x%08x %s\n",
+			   snd_pcm_format_name(f->format), pattern, received,
+			   ret ? "timeout" :
+			   received == pattern ? "ok" : "FAIL");
+	}
+
+	regcache_cache_bypass(mcasp->regmap, false);
+
+	for (i = 0; i < ARRAY_SIZE(davinci_mcasp_loopback_regs); i++)
+		regmap_write(mcasp->regmap, davinci_mcasp_loopback_regs[i],
+			     saved[i]);
+	regmap_write(mcasp->regmap, mcasp->fifo_base + MCASP_WFIFOCTL_OFFSET,
+		     fifo_ctl[0]);
+	regmap_write(mcasp->regmap, mcasp->fifo_base + MCASP_RFIFOCTL_OFFSET,
+		     fifo_ctl[1]);
+	regmap_write(mcasp->regmap, DAVINCI_MCASP_TXSTAT_REG, 0xFFFFFFFF);
+	regmap_write(mcasp->regmap, DAVINCI_MCASP_RXSTAT_REG, 0xFFFFFFFF);
+
+	pm_runtime_put(mcasp->dev);
+
+	spin_lock_irq(&mcasp->lock);
+	mcasp->loopback_running = false;
+	spin_unlock_irq(&mcasp->lock);
+
+	for (i = 0; i < ARRAY_SIZE(unsupported); i++)
+		seq_printf(s, "%-12s not supported, needs a byte swap\n",
+			   snd_pcm_format_name(unsupported[i]));
+
+	return 0;
+}
+
+static int davinci_mcasp_loopback_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, davinci_mcasp_loopback_show,
+			   inode->i_private);
+}
+
+static const struct file_operations davinci_mcasp_loopback_fops = {
+	.open		= davinci_mcasp_loopback_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const struct file_operations davinci_mcasp_tx_start_fops = {
+	.open		= davinci_mcasp_tx_start_open,
+	.read		= seq_read,
+	.write		= davinci_mcasp_tx_start_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void davinci_mcasp_init_debugfs(struct davinci_mcasp *mcasp)
+{
+	mcasp->debugfs_root = debugfs_create_dir(dev_name(mcasp->dev), NULL);
+	if (IS_ERR_OR_NULL(mcasp->debugfs_root)) {
+		dev_warn(mcasp->dev, "failed to create debugfs directory\n");
+		mcasp->debugfs_root = NULL;
+		return;
+	}
+
+	debugfs_create_file("afifo", 0444, mcasp->debugfs_root, mcasp,
+			    &davinci_mcasp_afifo_fops);
+	debugfs_create_file("hw_params", 0444, mcasp->debugfs_root, mcasp,
+			    &davinci_mcasp_hw_params_fops);
+	debugfs_create_file("channels", 0444, mcasp->debugfs_root, mcasp,
+			    &davinci_mcasp_channels_fops);
+	debugfs_create_file("tx_start", 0644, mcasp->debugfs_root, mcasp,
+			    &davinci_mcasp_tx_start_fops);
+	debugfs_create_file("xrun", 0444, mcasp->debugfs_root, mcasp,
+			    &davinci_mcasp_xrun_fops);
+	debugfs_create_file("clkchk", 0444, mcasp->debugfs_root, mcasp,
+			    &davinci_mcasp_clkchk_fops);
+	debugfs_create_file("loopback", 0400, mcasp->debugfs_root, mcasp,
+			    &davinci_mcasp_loopback_fops);
+}
+
+static void davinci_mcasp_cleanup_debugfs(struct davinci_mcasp *mcasp)
+{
+	debugfs_remove_recursive(mcasp->debugfs_root);
+}
+#else
+static inline void davinci_mcasp_init_debugfs(struct davinci_mcasp *mcasp)
+{
+}
+
+static inline void davinci_mcasp_cleanup_debugfs(struct davinci_mcasp *mcasp)
+{
+}
+#endif
+
 enum {
 	PCM_EDMA,
 	PCM_SDMA,
@@ -1998,6 +3587,74 @@ static u32 davinci_mcasp_rxdma_offset(struct davinci_mcasp_pdata *pdata)
 	return offset;
 }
 
+/* reset values (TRM) of the registers which do not reset to zero */
+static const struct reg_default davinci_mcasp_reset_regs[] = {
+	{ DAVINCI_MCASP_ACLKRCTL_REG, ACLKRE },
+	{ DAVINCI_MCASP_AHCLKRCTL_REG, AHCLKRE },
+	{ DAVINCI_MCASP_ACLKXCTL_REG, TX_ASYNC | ACLKXE },
+	{ DAVINCI_MCASP_AHCLKXCTL_REG, AHCLKXE },
+};
+
+static int davinci_mcasp_init_regmap(struct davinci_mcasp *mcasp)
+{
+	struct regmap_config config = davinci_mcasp_regmap_config;
+	unsigned int reg, val;
+	u32 *defaults;
+	int num_regs;
+	int i, ret = 0;
+
+	config.max_register = mcasp->fifo_base + MCASP_RFIFOSTS_OFFSET;
+	num_regs = config.max_register / config.reg_stride + 1;
+
+	defaults = devm_kcalloc(mcasp->dev, num_regs, sizeof(u32), GFP_KERNEL);
+	if (!defaults)
+		return -ENOMEM;
+
+	/*
+	 * The defaults are the reset values, the state after a context loss,
+	 * so that regcache_sync() restores every register changed since.
+	 */
+	for (i = 0; i < ARRAY_SIZE(davinci_mcasp_reset_regs); i++)
+		defaults[davinci_mcasp_reset_regs[i].reg / config.reg_stride] =
+			davinci_mcasp_reset_regs[i].def;
+	defaults[(mcasp->fifo_base + MCASP_WFIFOCTL_OFFSET) /
+		 config.reg_stride] = NUMEVT(0x10) | 4;
+	defaults[(mcasp->fifo_base + MCASP_RFIFOCTL_OFFSET) /
+		 config.reg_stride] = NUMEVT(0x10) | 4;
+
+	config.reg_defaults_raw = defaults;
+	config.num_reg_defaults_raw = num_regs;
+
+	mcasp->regmap = devm_regmap_init_mmio(mcasp->dev, mcasp->base, &config);
+	if (IS_ERR(mcasp->regmap)) {
+		dev_err(mcasp->dev, "failed to init regmap: %ld\n",
+			PTR_ERR(mcasp->regmap));
+		return PTR_ERR(mcasp->regmap);
+	}
+
+	/*
+	 * Keep the state left by the bootloader: written through the regmap
+	 * it is cached as a change from the reset values.
+	 */
+	pm_runtime_get_sync(mcasp->dev);
+	for (reg = 0; reg <= config.max_register; reg += config.reg_stride) {
+		if (!davinci_mcasp_writeable_reg(mcasp->dev, reg) ||
+		    davinci_mcasp_volatile_reg(mcasp->dev, reg))
+			continue;
+
+		val = __raw_readl(mcasp->base + reg);
+		if (val == defaults[reg / config.reg_stride])
+			continue;
+
+		ret = regmap_write(mcasp->regmap, reg, val);
+		if (ret)
+			break;
+	}
+	pm_runtime_put(mcasp->dev);
+
+	return ret;
+}
+
 static int davinci_mcasp_probe(struct platform_device *pdev)
 {
 	struct snd_dmaengine_dai_dma_data *dma_data;
@@ -2059,11 +3716,6 @@ static int davinci_mcasp_probe(struct platform_device *pdev)
 	}
 
 	mcasp->num_serializer = pdata->num_serializer;
-#ifdef CONFIG_PM_SLEEP
-	mcasp->context.xrsr_regs = devm_kzalloc(&pdev->dev,
-					sizeof(u32) * mcasp->num_serializer,
-					GFP_KERNEL);
-#endif
 	mcasp->serial_dir = pdata->serial_dir;
 	mcasp->version = pdata->version;
 	mcasp->txnumevt = pdata->txnumevt;
@@ -2073,6 +3725,20 @@ static int davinci_mcasp_probe(struct platform_device *pdev)
 	mcasp->autogpio_playing = pdata->autogpio_playing;
 
 	mcasp->dev = &pdev->dev;
+	spin_lock_init(&mcasp->lock);
+	INIT_DELAYED_WORK(&mcasp->clkchk_work, davinci_mcasp_clkchk_work);
+
+	if (mcasp->version < MCASP_VERSION_3)
+		mcasp->fifo_base = DAVINCI_MCASP_V2_AFIFO_BASE;
+	else
+		mcasp->fifo_base = DAVINCI_MCASP_V3_AFIFO_BASE;
+
+	/* the regmap access callbacks need the driver data */
+	dev_set_drvdata(&pdev->dev, mcasp);
+
+	ret = davinci_mcasp_init_regmap(mcasp);
+	if (ret)
+		goto err;
 
 	irq = platform_get_irq_byname(pdev, "common");
 	if (irq >= 0) {
@@ -2167,13 +3833,9 @@ static int davinci_mcasp_probe(struct platform_device *pdev)
 			dma_data->filter_data = dma;
 	}
 
-	if (mcasp->version < MCASP_VERSION_3) {
-		mcasp->fifo_base = DAVINCI_MCASP_V2_AFIFO_BASE;
-		/* dma_params->dma_addr is pointing to the data port address */
+	/* dma_params->dma_addr is pointing to the data port address */
+	if (mcasp->version < MCASP_VERSION_3)
 		mcasp->dat_port = true;
-	} else {
-		mcasp->fifo_base = DAVINCI_MCASP_V3_AFIFO_BASE;
-	}
 
 	/* Allocate memory for long enough list for all possible
 	 * scenarios. Maximum number tdm slots is 32 and there cannot
@@ -2200,16 +3862,25 @@ static int davinci_mcasp_probe(struct platform_device *pdev)
 	if (ret)
 		goto err;
 
-	dev_set_drvdata(&pdev->dev, mcasp);
-
 	mcasp_reparent_fck(pdev);
+	davinci_mcasp_get_fclk_rate(mcasp);
+
+	/*
+	 * The driver core has no dev_groups for the kernels this driver
+	 * builds against: add the attributes before the DAI can be bound
+	 * and tell userspace they are there.
+	 */
+	ret = device_add_groups(&pdev->dev, davinci_mcasp_groups);
+	if (ret)
+		goto err;
+	kobject_uevent(&pdev->dev.kobj, KOBJ_CHANGE);
 
 	ret = devm_snd_soc_register_component(&pdev->dev,
 					&davinci_mcasp_component,
 					&davinci_mcasp_dai[pdata->op_mode], 1);
 
 	if (ret != 0)
-		goto err;
+		goto err_groups;
 
 	ret = davinci_mcasp_get_dma_type(mcasp);
 	switch (ret) {
@@ -2221,7 +3892,7 @@ static int davinci_mcasp_probe(struct platform_device *pdev)
 #else
 		dev_err(&pdev->dev, "Missing SND_EDMA_SOC\n");
 		ret = -EINVAL;
-		goto err;
+		goto err_groups;
 #endif
 		break;
 	case PCM_SDMA:
@@ -2232,19 +3903,19 @@ static int davinci_mcasp_probe(struct platform_device *pdev)
 #else
 		dev_err(&pdev->dev, "Missing SND_SDMA_SOC\n");
 		ret = -EINVAL;
-		goto err;
+		goto err_groups;
 #endif
 		break;
 	default:
 		dev_err(&pdev->dev, "No DMA controller found (%d)\n", ret);
 	case -EPROBE_DEFER:
-		goto err;
+		goto err_groups;
 		break;
 	}
 
 	if (ret) {
 		dev_err(&pdev->dev, "register PCM failed: %d\n", ret);
-		goto err;
+		goto err_groups;
 	}
 
 	pm_runtime_get_sync(mcasp->dev);
@@ -2260,8 +3931,12 @@ static int davinci_mcasp_probe(struct platform_device *pdev)
 	
 	pm_runtime_put(mcasp->dev);
 
+	davinci_mcasp_init_debugfs(mcasp);
+
 	return 0;
 
+err_groups:
+	device_remove_groups(&pdev->dev, davinci_mcasp_groups);
 err:
 	pm_runtime_disable(&pdev->dev);
 	return ret;
@@ -2269,6 +3944,12 @@ err:
 
 static int davinci_mcasp_remove(struct platform_device *pdev)
 {
+	struct davinci_mcasp *mcasp = dev_get_drvdata(&pdev->dev);
+
+	davinci_mcasp_cleanup_debugfs(mcasp);
+	device_remove_groups(&pdev->dev, davinci_mcasp_groups);
+	cancel_delayed_work_sync(&mcasp->clkchk_work);
+
 	pm_runtime_disable(&pdev->dev);
 
 	return 0;
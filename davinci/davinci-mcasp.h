@@ -261,6 +261,18 @@
  */
 #define XRERR		BIT(8) /* Transmit/Receive error */
 #define XRDATA		BIT(5) /* Transmit/Receive data ready */
+#define XCKFAIL		BIT(2) /* Transmit/Receive clock failure */
+
+/*
+ * DAVINCI_MCASP_TXCLKCHK_REG - Transmit Clock Check Control Register Bits
+ * DAVINCI_MCASP_RXCLKCHK_REG - Receive Clock Check Control Register Bits
+ */
+#define CLKCHK_PS(val)	(val)		/* prescaler, 2^val */
+#define CLKCHK_PS_MASK	0xf
+#define CLKCHK_MIN(val)	((val) << 8)
+#define CLKCHK_MAX(val)	((val) << 16)
+#define CLKCHK_MINMAX_MASK	(0xff << 8 | 0xff << 16)
+#define CLKCHK_CNT(reg)	(((reg) >> 24) & 0xff)
 
 /*
  * DAVINCI_MCASP_AMUTE_REG -  Mute Control Register Bits
@@ -306,9 +318,20 @@
 #define NUMEVT(x)	(((x) & 0xFF) << 8)
 #define NUMDMA_MASK	(0xFF)
 
+/*
+ * DAVINCI_MCASP_W[R]FIFOSTS - Write/Read FIFO Status Register bits
+ */
+#define FIFO_LVL_MASK	(0xFF)
+
 /* clock divider IDs */
 #define MCASP_CLKDIV_AUXCLK		0 /* HCLK divider from AUXCLK */
 #define MCASP_CLKDIV_BCLK		1 /* BCLK divider from HCLK */
 #define MCASP_CLKDIV_BCLK_FS_RATIO	2 /* to set BCLK FS ration */
+#define MCASP_CLKDIV_AUXCLK_RX		3 /* AHCLKR divider in async RX mode */
+#define MCASP_CLKDIV_BCLK_RX		4 /* ACLKR divider in async RX mode */
+
+/* system clock IDs */
+#define MCASP_SYSCLK_AUXCLK		0 /* AHCLKX, AHCLKR too if synchronous */
+#define MCASP_SYSCLK_RX			1 /* AHCLKR, 0 Hz for synchronous RX */
 
 #endif	/* DAVINCI_MCASP_H */
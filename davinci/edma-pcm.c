@@ -18,6 +18,12 @@
  */
 
 #include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/hrtimer.h>
+#include <linux/dmaengine.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/of.h>
 #include <sound/core.h>
 #include <sound/pcm.h>
 #include <sound/pcm_params.h>
@@ -27,30 +33,758 @@
 
 #include "edma-pcm.h"
 
+/*
+ * The edma dmaengine driver can not handle more than 19 periods in a cyclic
+ * transfer. ALSA periods are therefore decoupled from DMA periods: a buffer
+ * with more periods is transferred with fewer, larger DMA periods and the
+ * period wakeups are generated by a timer. The position is always derived
+ * from the DMA residue so it does not depend on the DMA period size.
+ */
+#define EDMA_PCM_DMA_PERIODS_MAX	19
+#define EDMA_PCM_PERIODS_MAX		1024
+/* lower limit for the period time, keeps the timer rate sane */
+#define EDMA_PCM_PERIOD_TIME_MIN	250 /* us */
+
 static const struct snd_pcm_hardware edma_pcm_hardware = {
 	.info			= SNDRV_PCM_INFO_MMAP |
 				  SNDRV_PCM_INFO_MMAP_VALID |
 				  SNDRV_PCM_INFO_PAUSE | SNDRV_PCM_INFO_RESUME |
 				  SNDRV_PCM_INFO_NO_PERIOD_WAKEUP |
+				  SNDRV_PCM_INFO_HAS_LINK_ATIME |
 				  SNDRV_PCM_INFO_INTERLEAVED,
 	.buffer_bytes_max	= 24 * 128 * 1024,
 	.period_bytes_min	= 32,
 	.period_bytes_max	= 24 * 64 * 1024,
 	.periods_min		= 2,
-	.periods_max		= 19, /* Limit by edma dmaengine driver */
+	.periods_max		= EDMA_PCM_PERIODS_MAX,
+};
+
+/*
+ * Buffer sizes, from the DT node of the McASP or the module parameters
+ * (which win if set). A buffer bigger than the preallocated one, and any
+ * buffer of a stream without preallocation, is allocated at hw_params. By
+ * default only the playback is preallocated, the capture is not used by
+ * most serializer configurations.
+ */
+#define EDMA_PCM_PREALLOC_BUFFER_SIZE	(24 * 128 * 1024)
+
+static int buffer_bytes_max = -1;
+module_param(buffer_bytes_max, int, 0444);
+MODULE_PARM_DESC(buffer_bytes_max, "Largest DMA buffer in bytes");
+
+static int period_bytes_max = -1;
+module_param(period_bytes_max, int, 0444);
+MODULE_PARM_DESC(period_bytes_max, "Largest period in bytes");
+
+static int periods_max = -1;
+module_param(periods_max, int, 0444);
+MODULE_PARM_DESC(periods_max, "Largest number of periods in a buffer");
+
+static int prealloc_playback = -1;
+module_param(prealloc_playback, int, 0444);
+MODULE_PARM_DESC(prealloc_playback,
+		 "Preallocated playback buffer in bytes, 0 allocates at hw_params");
+
+static int prealloc_capture = -1;
+module_param(prealloc_capture, int, 0444);
+MODULE_PARM_DESC(prealloc_capture,
+		 "Preallocated capture buffer in bytes, 0 allocates at hw_params");
+
+/* DMA buffer of a stream */
+struct edma_pcm_mem {
+	size_t prealloc;	/* preallocated at pcm_new */
+	size_t in_use;		/* buffer of the current hw_params */
+	bool lazy;		/* in_use was allocated at hw_params */
+	unsigned int lazy_allocs;
+	unsigned int failures;
 };
 
-static const struct snd_dmaengine_pcm_config edma_dmaengine_pcm_config = {
-	.pcm_hardware = &edma_pcm_hardware,
-	.prepare_slave_config = snd_dmaengine_pcm_prepare_slave_config,
-	.compat_filter_fn = edma_filter_fn,
-	.prealloc_buffer_size = 24 * 128 * 1024,
+/* Statistics of the last run of a stream */
+struct edma_pcm_stats {
+	unsigned int periods;
+	snd_pcm_uframes_t period_size;
+	unsigned int rate;
+	unsigned int dma_periods;
+	ktime_t start;
+	ktime_t stop;
+	u64 wakeups;
+	snd_pcm_sframes_t min_margin;	/* -1 if not known yet */
+	unsigned int xruns;
 };
 
+struct edma_pcm {
+	struct snd_soc_platform platform;
+	struct snd_pcm_hardware hw;
+	size_t prealloc[2];
+	struct dma_chan *chan[2];
+	struct edma_pcm_stats stats[2];
+	struct edma_pcm_mem mem[2];
+};
+
+struct edma_pcm_runtime {
+	struct snd_pcm_substream *substream;
+	struct dma_chan *chan;
+	dma_cookie_t cookie;
+	struct edma_pcm_stats *stats;
+	struct edma_pcm_mem *mem;
+
+	unsigned int dma_period_bytes;
+	/* a DMA period spans several ALSA periods */
+	bool coalesced;
+	/* the period wakeups come from the timer if set */
+	bool use_timer;
+	bool timer_running;
+	struct hrtimer timer;
+	ktime_t period_time;
+};
+
+static inline struct edma_pcm *soc_platform_to_edma_pcm(
+	struct snd_soc_platform *platform)
+{
+	return container_of(platform, struct edma_pcm, platform);
+}
+
+static void edma_pcm_period_elapsed(struct edma_pcm_runtime *prtd)
+{
+	struct snd_pcm_substream *substream = prtd->substream;
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct edma_pcm_stats *stats = prtd->stats;
+	snd_pcm_sframes_t margin = -1;
+	unsigned long flags;
+
+	snd_pcm_period_elapsed(substream);
+
+	/* frames left before an XRUN would happen */
+	snd_pcm_stream_lock_irqsave(substream, flags);
+	if (runtime->status->state == SNDRV_PCM_STATE_RUNNING) {
+		if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
+			margin = snd_pcm_playback_hw_avail(runtime);
+		else
+			margin = snd_pcm_capture_hw_avail(runtime);
+	} else if (runtime->status->state == SNDRV_PCM_STATE_XRUN) {
+		stats->xruns++;
+	}
+	snd_pcm_stream_unlock_irqrestore(substream, flags);
+
+	stats->wakeups++;
+	if (margin >= 0 && (stats->min_margin < 0 || margin < stats->min_margin))
+		stats->min_margin = margin;
+}
+
+static void edma_pcm_dma_complete(void *arg)
+{
+	struct edma_pcm_runtime *prtd = arg;
+
+	if (!prtd->use_timer)
+		edma_pcm_period_elapsed(prtd);
+}
+
+static enum hrtimer_restart edma_pcm_timer(struct hrtimer *timer)
+{
+	struct edma_pcm_runtime *prtd =
+		container_of(timer, struct edma_pcm_runtime, timer);
+
+	if (!READ_ONCE(prtd->timer_running))
+		return HRTIMER_NORESTART;
+
+	edma_pcm_period_elapsed(prtd);
+
+	/*
+	 * A stop may have run while the callback waited for the stream lock,
+	 * its hrtimer_try_to_cancel() failed and a start may have queued the
+	 * timer again already.
+	 */
+	if (!READ_ONCE(prtd->timer_running) || hrtimer_is_queued(timer))
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(timer, prtd->period_time);
+	return HRTIMER_RESTART;
+}
+
+static void edma_pcm_timer_start(struct edma_pcm_runtime *prtd)
+{
+	if (!prtd->use_timer)
+		return;
+
+	WRITE_ONCE(prtd->timer_running, true);
+	hrtimer_start(&prtd->timer, prtd->period_time, HRTIMER_MODE_REL);
+}
+
+/* called with the stream lock held, the callback may be waiting for it */
+static void edma_pcm_timer_stop(struct edma_pcm_runtime *prtd)
+{
+	WRITE_ONCE(prtd->timer_running, false);
+	hrtimer_try_to_cancel(&prtd->timer);
+}
+
+static int edma_pcm_open(struct snd_pcm_substream *substream)
+{
+	struct snd_soc_pcm_runtime *rtd = substream->private_data;
+	struct edma_pcm *epcm = soc_platform_to_edma_pcm(rtd->platform);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct edma_pcm_runtime *prtd;
+	int ret;
+
+	ret = snd_soc_set_runtime_hwparams(substream, &epcm->hw);
+	if (ret)
+		return ret;
+
+	ret = snd_pcm_hw_constraint_integer(runtime,
+					    SNDRV_PCM_HW_PARAM_PERIODS);
+	if (ret < 0)
+		return ret;
+
+	ret = snd_pcm_hw_constraint_minmax(runtime,
+					   SNDRV_PCM_HW_PARAM_PERIOD_TIME,
+					   EDMA_PCM_PERIOD_TIME_MIN, UINT_MAX);
+	if (ret < 0)
+		return ret;
+
+	prtd = kzalloc(sizeof(*prtd), GFP_KERNEL);
+	if (!prtd)
+		return -ENOMEM;
+
+	prtd->substream = substream;
+	prtd->chan = epcm->chan[substream->stream];
+	prtd->stats = &epcm->stats[substream->stream];
+	prtd->mem = &epcm->mem[substream->stream];
+	hrtimer_init(&prtd->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	prtd->timer.function = edma_pcm_timer;
+
+	runtime->private_data = prtd;
+
+	return 0;
+}
+
+static int edma_pcm_close(struct snd_pcm_substream *substream)
+{
+	struct edma_pcm_runtime *prtd = substream->runtime->private_data;
+
+	hrtimer_cancel(&prtd->timer);
+	kfree(prtd);
+
+	return 0;
+}
+
+static int edma_pcm_hw_params(struct snd_pcm_substream *substream,
+			      struct snd_pcm_hw_params *params)
+{
+	struct edma_pcm_runtime *prtd = substream->runtime->private_data;
+	struct dma_slave_config config;
+	unsigned int periods = params_periods(params);
+	unsigned int per_dma = DIV_ROUND_UP(periods, EDMA_PCM_DMA_PERIODS_MAX);
+	int ret;
+
+	memset(&config, 0, sizeof(config));
+	ret = snd_dmaengine_pcm_prepare_slave_config(substream, params,
+						     &config);
+	if (ret)
+		return ret;
+
+	ret = dmaengine_slave_config(prtd->chan, &config);
+	if (ret)
+		return ret;
+
+	/* DMA periods have to cover a whole number of ALSA periods */
+	while (periods % per_dma)
+		per_dma++;
+
+	prtd->dma_period_bytes = params_period_bytes(params) * per_dma;
+	prtd->coalesced = per_dma > 1;
+	prtd->period_time = ns_to_ktime(div_u64((u64)params_period_size(params) *
+						NSEC_PER_SEC,
+						params_rate(params)));
+
+	prtd->stats->periods = periods;
+	prtd->stats->period_size = params_period_size(params);
+	prtd->stats->rate = params_rate(params);
+	prtd->stats->dma_periods = periods / per_dma;
+
+	/* falls back to a new buffer if the preallocated one is too small */
+	ret = snd_pcm_lib_malloc_pages(substream, params_buffer_bytes(params));
+	if (ret < 0) {
+		prtd->mem->failures++;
+		return ret;
+	}
+
+	prtd->mem->in_use = substream->runtime->dma_bytes;
+	prtd->mem->lazy = substream->runtime->dma_buffer_p !=
+			  &substream->dma_buffer;
+	if (ret > 0 && prtd->mem->lazy)
+		prtd->mem->lazy_allocs++;
+
+	return 0;
+}
+
+static int edma_pcm_hw_free(struct snd_pcm_substream *substream)
+{
+	struct edma_pcm_runtime *prtd = substream->runtime->private_data;
+
+	hrtimer_cancel(&prtd->timer);
+
+	prtd->mem->in_use = 0;
+	prtd->mem->lazy = false;
+
+	return snd_pcm_lib_free_pages(substream);
+}
+
+static int edma_pcm_prepare_and_submit(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct edma_pcm_runtime *prtd = runtime->private_data;
+	struct dma_async_tx_descriptor *desc;
+	enum dma_transfer_direction direction;
+	unsigned long flags = DMA_CTRL_ACK;
+
+	direction = snd_pcm_substream_to_dma_direction(substream);
+
+	/* no_period_wakeup is only known after hw_params */
+	prtd->use_timer = prtd->coalesced && !runtime->no_period_wakeup;
+	if (!runtime->no_period_wakeup && !prtd->use_timer)
+		flags |= DMA_PREP_INTERRUPT;
+
+	desc = dmaengine_prep_dma_cyclic(prtd->chan,
+					 runtime->dma_addr,
+					 snd_pcm_lib_buffer_bytes(substream),
+					 prtd->dma_period_bytes, direction,
+					 flags);
+	if (!desc)
+		return -ENOMEM;
+
+	desc->callback = edma_pcm_dma_complete;
+	desc->callback_param = prtd;
+	prtd->cookie = dmaengine_submit(desc);
+
+	return 0;
+}
+
+static void edma_pcm_stats_start(struct edma_pcm_runtime *prtd)
+{
+	struct edma_pcm_stats *stats = prtd->stats;
+
+	stats->start = ktime_get();
+	stats->stop = ktime_set(0, 0);
+	stats->wakeups = 0;
+	stats->min_margin = -1;
+	stats->xruns = 0;
+}
+
+static int edma_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
+{
+	struct edma_pcm_runtime *prtd = substream->runtime->private_data;
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	int ret;
+
+	switch (cmd) {
+	case SNDRV_PCM_TRIGGER_START:
+		ret = edma_pcm_prepare_and_submit(substream);
+		if (ret)
+			return ret;
+		dma_async_issue_pending(prtd->chan);
+		edma_pcm_stats_start(prtd);
+		edma_pcm_timer_start(prtd);
+		break;
+	case SNDRV_PCM_TRIGGER_RESUME:
+	case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
+		dmaengine_resume(prtd->chan);
+		edma_pcm_timer_start(prtd);
+		break;
+	case SNDRV_PCM_TRIGGER_SUSPEND:
+		edma_pcm_timer_stop(prtd);
+		if (runtime->info & SNDRV_PCM_INFO_PAUSE)
+			dmaengine_pause(prtd->chan);
+		else
+			dmaengine_terminate_all(prtd->chan);
+		break;
+	case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
+		edma_pcm_timer_stop(prtd);
+		dmaengine_pause(prtd->chan);
+		break;
+	case SNDRV_PCM_TRIGGER_STOP:
+		edma_pcm_timer_stop(prtd);
+		dmaengine_terminate_all(prtd->chan);
+		prtd->stats->stop = ktime_get();
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static snd_pcm_uframes_t edma_pcm_pointer(struct snd_pcm_substream *substream)
+{
+	struct edma_pcm_runtime *prtd = substream->runtime->private_data;
+	unsigned int buf_size = snd_pcm_lib_buffer_bytes(substream);
+	struct dma_tx_state state;
+	unsigned int pos = 0;
+
+	dmaengine_tx_status(prtd->chan, prtd->cookie, &state);
+	if (state.residue > 0 && state.residue <= buf_size)
+		pos = buf_size - state.residue;
+
+	return bytes_to_frames(substream->runtime, pos);
+}
+
+/*
+ * Link timestamp: the DMA position corrected by the frames still queued in
+ * the DAI (AFIFO and serializers) as reported by its delay callback. The
+ * residue moves in DMA bursts while the AFIFO level moves word by word, so
+ * the sum is accurate to about one frame.
+ */
+static int edma_pcm_get_time_info(struct snd_pcm_substream *substream,
+			struct timespec *system_ts, struct timespec *audio_ts,
+			struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+			struct snd_pcm_audio_tstamp_report *audio_tstamp_report)
+{
+	struct snd_soc_pcm_runtime *rtd = substream->private_data;
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct snd_soc_dai *cpu_dai = rtd->cpu_dai;
+	snd_pcm_uframes_t pos, last_pos;
+	snd_pcm_sframes_t delay = 0;
+	u64 frames;
+	int retries = 3;
+
+	if (audio_tstamp_config->type_requested !=
+	    SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK) {
+		audio_tstamp_report->actual_type =
+			SNDRV_PCM_AUDIO_TSTAMP_TYPE_DEFAULT;
+		return 0;
+	}
+
+	/* the DAI delay has to belong to the same DMA position */
+	pos = edma_pcm_pointer(substream);
+	do {
+		if (cpu_dai->driver->ops && cpu_dai->driver->ops->delay)
+			delay = cpu_dai->driver->ops->delay(substream, cpu_dai);
+		snd_pcm_gettime(runtime, system_ts);
+		last_pos = pos;
+		pos = edma_pcm_pointer(substream);
+	} while (pos != last_pos && --retries);
+
+	/* hw_ptr is not updated yet, the DMA may have wrapped since */
+	frames = runtime->hw_ptr_base + pos;
+	if (frames < runtime->status->hw_ptr)
+		frames += runtime->buffer_size;
+	frames += runtime->hw_ptr_wrap;
+
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
+		frames -= min_t(u64, frames, delay);
+	else
+		frames += delay;
+
+	*audio_ts = ns_to_timespec(div_u64(frames * NSEC_PER_SEC,
+					   runtime->rate));
+
+	audio_tstamp_report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK;
+	audio_tstamp_report->accuracy_report = 1;
+	audio_tstamp_report->accuracy = div_u64(NSEC_PER_SEC, runtime->rate);
+
+	return 0;
+}
+
+static const struct snd_pcm_ops edma_pcm_ops = {
+	.open		= edma_pcm_open,
+	.close		= edma_pcm_close,
+	.ioctl		= snd_pcm_lib_ioctl,
+	.hw_params	= edma_pcm_hw_params,
+	.hw_free	= edma_pcm_hw_free,
+	.trigger	= edma_pcm_trigger,
+	.pointer	= edma_pcm_pointer,
+};
+
+static struct dma_chan *edma_pcm_request_chan(struct device *dev,
+		struct snd_dmaengine_dai_dma_data *dma_data)
+{
+	/* filter_data is the channel name for DT and the channel otherwise */
+	if (dev->of_node)
+		return dma_request_slave_channel(dev, dma_data->filter_data);
+
+	return snd_dmaengine_pcm_request_channel(edma_filter_fn,
+						 dma_data->filter_data);
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int edma_pcm_dma_show(struct seq_file *s, void *unused)
+{
+	struct edma_pcm *epcm = s->private;
+	static const char * const names[] = { "playback", "capture" };
+	int stream;
+
+	for (stream = 0; stream < ARRAY_SIZE(names); stream++) {
+		struct edma_pcm_stats *stats = &epcm->stats[stream];
+		ktime_t stop = stats->stop;
+		u64 ms, margin_us = 0;
+
+		if (!epcm->chan[stream] || !stats->rate)
+			continue;
+
+		if (!ktime_to_ns(stop))
+			stop = ktime_get();
+		ms = ktime_ms_delta(stop, stats->start);
+		if (stats->min_margin > 0)
+			margin_us = div_u64((u64)stats->min_margin *
+					    USEC_PER_SEC, stats->rate);
+
+		seq_printf(s, "%s: %u periods of %lu frames, %u dma periods\n",
+			   names[stream], stats->periods, stats->period_size,
+			   stats->dma_periods);
+		seq_printf(s, "  wakeups %llu in %llu ms (%llu/s)\n",
+			   stats->wakeups, ms,
+			   ms ? div64_u64(stats->wakeups * MSEC_PER_SEC, ms) : 0);
+		seq_printf(s, "  min margin %ld frames (%llu us), xruns %u\n",
+			   stats->min_margin, margin_us, stats->xruns);
+	}
+
+	return 0;
+}
+
+static int edma_pcm_dma_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, edma_pcm_dma_show, inode->i_private);
+}
+
+static const struct file_operations edma_pcm_dma_fops = {
+	.open		= edma_pcm_dma_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int edma_pcm_memory_show(struct seq_file *s, void *unused)
+{
+	struct edma_pcm *epcm = s->private;
+	static const char * const names[] = { "playback", "capture" };
+	size_t total = 0;
+	int stream;
+
+	seq_printf(s, "buffer max %zu bytes, period max %zu bytes, periods max %u\n",
+		   epcm->hw.buffer_bytes_max, epcm->hw.period_bytes_max,
+		   epcm->hw.periods_max);
+
+	for (stream = 0; stream < ARRAY_SIZE(names); stream++) {
+		struct edma_pcm_mem *mem = &epcm->mem[stream];
+
+		if (!epcm->chan[stream])
+			continue;
+
+		seq_printf(s, "%s: preallocated %zu bytes, in use %zu bytes%s\n",
+			   names[stream], mem->prealloc, mem->in_use,
+			   mem->lazy ? " (allocated at hw_params)" : "");
+		seq_printf(s, "  allocations at hw_params %u, failures %u\n",
+			   mem->lazy_allocs, mem->failures);
+
+		total += mem->prealloc;
+		if (mem->lazy)
+			total += mem->in_use;
+	}
+
+	seq_printf(s, "total %zu bytes\n", total);
+
+	return 0;
+}
+
+static int edma_pcm_memory_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, edma_pcm_memory_show, inode->i_private);
+}
+
+static const struct file_operations edma_pcm_memory_fops = {
+	.open		= edma_pcm_memory_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void edma_pcm_init_debugfs(struct edma_pcm *epcm)
+{
+	struct dentry *root = epcm->platform.component.debugfs_root;
+
+	/* removed together with the component directory */
+	if (!root)
+		return;
+
+	debugfs_create_file("dma", 0444, root, epcm, &edma_pcm_dma_fops);
+	debugfs_create_file("memory", 0444, root, epcm,
+			    &edma_pcm_memory_fops);
+}
+#else
+static inline void edma_pcm_init_debugfs(struct edma_pcm *epcm)
+{
+}
+#endif
+
+static void edma_pcm_free(struct snd_pcm *pcm)
+{
+	struct snd_soc_pcm_runtime *rtd = pcm->private_data;
+	struct edma_pcm *epcm = soc_platform_to_edma_pcm(rtd->platform);
+	unsigned int i;
+
+	snd_pcm_lib_preallocate_free_for_all(pcm);
+
+	/* the card may use a separate PCM for each direction */
+	for (i = SNDRV_PCM_STREAM_PLAYBACK; i <= SNDRV_PCM_STREAM_CAPTURE; i++) {
+		if (pcm->streams[i].substream && epcm->chan[i]) {
+			dma_release_channel(epcm->chan[i]);
+			epcm->chan[i] = NULL;
+			epcm->mem[i].prealloc = 0;
+		}
+	}
+}
+
+static int edma_pcm_new(struct snd_soc_pcm_runtime *rtd)
+{
+	struct edma_pcm *epcm = soc_platform_to_edma_pcm(rtd->platform);
+	struct device *dev = rtd->platform->dev;
+	struct snd_pcm_substream *substream;
+	unsigned int i;
+	int ret;
+
+	/* the channels are per platform, one PCM per direction at most */
+	for (i = SNDRV_PCM_STREAM_PLAYBACK; i <= SNDRV_PCM_STREAM_CAPTURE; i++) {
+		if (rtd->pcm->streams[i].substream && epcm->chan[i]) {
+			dev_err(dev, "stream %d is used by another PCM\n", i);
+			return -EBUSY;
+		}
+	}
+
+	for (i = SNDRV_PCM_STREAM_PLAYBACK; i <= SNDRV_PCM_STREAM_CAPTURE; i++) {
+		substream = rtd->pcm->streams[i].substream;
+		if (!substream)
+			continue;
+
+		epcm->chan[i] = edma_pcm_request_chan(dev,
+			snd_soc_dai_get_dma_data(rtd->cpu_dai, substream));
+		if (!epcm->chan[i]) {
+			dev_err(dev, "Missing dma channel for stream: %d\n", i);
+			ret = -EINVAL;
+			goto err_free;
+		}
+
+		/* a size of 0 only sets up the device for hw_params */
+		ret = snd_pcm_lib_preallocate_pages(substream,
+				SNDRV_DMA_TYPE_DEV,
+				epcm->chan[i]->device->dev,
+				epcm->prealloc[i], epcm->hw.buffer_bytes_max);
+		if (ret)
+			goto err_free;
+
+		/* the core retries with smaller sizes if memory is short */
+		epcm->mem[i].prealloc = substream->dma_buffer.bytes;
+		if (epcm->mem[i].prealloc < epcm->prealloc[i])
+			dev_warn(dev, "stream %d: preallocated %zu of %zu bytes\n",
+				 i, epcm->mem[i].prealloc, epcm->prealloc[i]);
+	}
+
+	/* the ASoC core does not take get_time_info from the platform */
+	rtd->ops.get_time_info = edma_pcm_get_time_info;
+
+	return 0;
+
+err_free:
+	edma_pcm_free(rtd->pcm);
+	return ret;
+}
+
+/* pcm_new runs once for every DAI link, the debugfs file is per platform */
+static int edma_pcm_probe(struct snd_soc_platform *platform)
+{
+	edma_pcm_init_debugfs(soc_platform_to_edma_pcm(platform));
+
+	return 0;
+}
+
+static const struct snd_soc_platform_driver edma_pcm_platform = {
+	.component_driver = {
+		.probe_order = SND_SOC_COMP_ORDER_LATE,
+	},
+	.probe		= edma_pcm_probe,
+	.ops		= &edma_pcm_ops,
+	.pcm_new	= edma_pcm_new,
+	.pcm_free	= edma_pcm_free,
+};
+
+/* a module parameter overrides the DT property, -1 means unset */
+static size_t edma_pcm_get_size(struct device *dev, const char *propname,
+				int param, size_t def)
+{
+	u32 val;
+
+	if (param >= 0)
+		return param;
+
+	if (dev->of_node && !of_property_read_u32(dev->of_node, propname, &val))
+		return val;
+
+	return def;
+}
+
+static int edma_pcm_init_hw(struct device *dev, struct edma_pcm *epcm)
+{
+	struct snd_pcm_hardware *hw = &epcm->hw;
+
+	*hw = edma_pcm_hardware;
+	hw->buffer_bytes_max = edma_pcm_get_size(dev, "dma-buffer-size-max",
+			buffer_bytes_max, hw->buffer_bytes_max);
+	hw->period_bytes_max = edma_pcm_get_size(dev, "dma-period-size-max",
+			period_bytes_max, hw->period_bytes_max);
+	hw->periods_max = edma_pcm_get_size(dev, "dma-periods-max",
+			periods_max, hw->periods_max);
+	epcm->prealloc[SNDRV_PCM_STREAM_PLAYBACK] = edma_pcm_get_size(dev,
+			"dma-prealloc-playback", prealloc_playback,
+			EDMA_PCM_PREALLOC_BUFFER_SIZE);
+	epcm->prealloc[SNDRV_PCM_STREAM_CAPTURE] = edma_pcm_get_size(dev,
+			"dma-prealloc-capture", prealloc_capture, 0);
+
+	if (hw->buffer_bytes_max < 2 * hw->period_bytes_min ||
+	    hw->periods_max < hw->periods_min) {
+		dev_err(dev, "invalid DMA buffer limits\n");
+		return -EINVAL;
+	}
+
+	/* two periods have to fit into the buffer */
+	hw->period_bytes_max = clamp_t(size_t, hw->period_bytes_max,
+				       hw->period_bytes_min,
+				       hw->buffer_bytes_max / 2);
+	epcm->prealloc[0] = min(epcm->prealloc[0], hw->buffer_bytes_max);
+	epcm->prealloc[1] = min(epcm->prealloc[1], hw->buffer_bytes_max);
+
+	dev_dbg(dev, "DMA buffer max %zu, period max %zu, prealloc %zu/%zu\n",
+		hw->buffer_bytes_max, hw->period_bytes_max,
+		epcm->prealloc[0], epcm->prealloc[1]);
+
+	return 0;
+}
+
+static void edma_pcm_platform_unregister(void *data)
+{
+	struct edma_pcm *epcm = data;
+
+	snd_soc_remove_platform(&epcm->platform);
+}
+
 int edma_pcm_platform_register(struct device *dev)
 {
-	return devm_snd_dmaengine_pcm_register(dev, &edma_dmaengine_pcm_config,
-					SND_DMAENGINE_PCM_FLAG_COMPAT);
+	struct edma_pcm *epcm;
+	int ret;
+
+	epcm = devm_kzalloc(dev, sizeof(*epcm), GFP_KERNEL);
+	if (!epcm)
+		return -ENOMEM;
+
+	ret = edma_pcm_init_hw(dev, epcm);
+	if (ret)
+		return ret;
+
+	ret = snd_soc_add_platform(dev, &epcm->platform, &edma_pcm_platform);
+	if (ret)
+		return ret;
+
+	ret = devm_add_action(dev, edma_pcm_platform_unregister, epcm);
+	if (ret)
+		snd_soc_remove_platform(&epcm->platform);
+
+	return ret;
 }
 EXPORT_SYMBOL_GPL(edma_pcm_platform_register);
 
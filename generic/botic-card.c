@@ -9,6 +9,7 @@
  */
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/mutex.h>
 #include <linux/timer.h>
 #include <linux/interrupt.h>
 #include <linux/platform_device.h>
@@ -26,6 +27,12 @@
 #include <linux/delay.h>
 
 #include <linux/of_gpio.h>
+#include <linux/pm_runtime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+
+#include "sabre32.h"
 
 #define ENABLE_EXT_MASTERCLK_44K1 1
 #define ENABLE_EXT_MASTERCLK_48K 2
@@ -35,6 +42,10 @@
 #define ENABLE_DSD_FORMAT_SWITCH 1
 #define ENABLE_DSD_FORMAT_SWITCH_INVERT 2
 
+/* McASP clock IDs, see davinci-mcasp.h */
+#define BOTIC_MCASP_SYSCLK_RX 1
+#define BOTIC_MCASP_CLKDIV_BCLK_RX 4
+
 static int gpio_int_masterclk_enable = -1;
 static int gpio_ext_masterclk_switch = -1;
 static int gpio_dsd_format_switch = -1;
@@ -52,6 +63,14 @@ static int clk_44k1 = 22579200;
 static int clk_48k = 24576000;
 static int blr_ratio = 64;
 
+/* power the cape down after this many ms without an open stream, -1 never */
+static int autosuspend_ms = -1;
+
+/* sync (capture runs from the playback clocks) or ext (MCLK on AHCLKR) */
+static char *capture_clk = "sync";
+static int capture_mclk_fs = 256;
+static bool botic_capture_async;
+
 static int is_dsd(snd_pcm_format_t format)
 {
     switch (format) {
@@ -69,6 +88,25 @@ static int is_dsd(snd_pcm_format_t format)
     }
 }
 
+/* serializers assigned to each use by serconfig, one bit per serializer */
+struct botic_ser_config {
+    u8 pcm;
+    u8 dsd;
+    u8 spdif;
+    u8 rx;
+};
+
+static struct botic_ser_config botic_ser_config;
+/* incremented on every change of botic_ser_config, 0 is never used */
+static unsigned int botic_ser_generation;
+static DEFINE_MUTEX(botic_ser_lock);
+
+/* channel map last passed to the CPU DAI */
+static struct {
+    unsigned int generation;
+    bool dsd;
+} botic_ser_applied;
+
 struct botic_ser_setup {
     int dai_fmt;
     int nch_tx;
@@ -77,238 +115,993 @@ struct botic_ser_setup {
     int rx_slots[4];
 };
 
-static int botic_setup_serializers(struct snd_soc_dai *cpu_dai,
-        snd_pcm_format_t format, struct botic_ser_setup *ser_setup)
+static int botic_parse_serconfig(const char *config,
+        struct botic_ser_config *cfg)
 {
-    int n_i2s = 0;
-    int n_dsd = 0;
-    int n_spdif = 0;
+    int len = strlen(config);
     int i;
-    int ret;
 
-    /* clear serializer setup */
-    memset(ser_setup, 0, sizeof(*ser_setup));
+    memset(cfg, 0, sizeof(*cfg));
+
+    /* allow the newline of "echo MMMM > serconfig" */
+    if (len == 5 && config[4] == '\n')
+        len = 4;
+    if (len != 4) {
+        printk(KERN_ERR "botic-card: serconfig needs 4 characters\n");
+        return -EINVAL;
+    }
 
     for (i = 0; i < 4; i++) {
-        switch (serconfig[i]) {
+        switch (config[i]) {
             case 'I':
-                if (is_dsd(format)) continue;
-                n_i2s++;
+                cfg->pcm |= BIT(i);
                 break;
             case 'D':
-                if (!is_dsd(format)) continue;
-                n_dsd++;
+                cfg->dsd |= BIT(i);
                 break;
             case 'M':
-                n_i2s++;
-                n_dsd++;
+                cfg->pcm |= BIT(i);
+                cfg->dsd |= BIT(i);
                 break;
             case 'S':
-                n_spdif++;
+                cfg->spdif |= BIT(i);
                 break;
             case 'R':
-                ser_setup->rx_slots[ser_setup->nch_rx++] = i;
-                continue;
+                cfg->rx |= BIT(i);
+                break;
             case '-':
-                continue;
+                break;
             default:
                 printk(KERN_ERR "botic-card: invalid character '%c'"
-                       " in serconfig\n", serconfig[i]);
+                       " in serconfig\n", config[i]);
                 return -EINVAL;
-                break;
         }
-        ser_setup->tx_slots[ser_setup->nch_tx++] = i;
     }
 
-    if (n_spdif > 0 && (n_i2s + n_dsd) != 0) {
-        printk(KERN_ERR "botic-card: SPDIF cannot be combined with other formats");
+    if (cfg->spdif && (cfg->pcm | cfg->dsd)) {
+        printk(KERN_ERR "botic-card: SPDIF cannot be combined with other formats\n");
         return -EINVAL;
     }
 
-    if (n_dsd == 0 && is_dsd(format)) {
+    return 0;
+}
+
+static void botic_set_ser_config(const struct botic_ser_config *cfg)
+{
+    mutex_lock(&botic_ser_lock);
+    botic_ser_config = *cfg;
+    if (++botic_ser_generation == 0)
+        botic_ser_generation = 1;
+    mutex_unlock(&botic_ser_lock);
+}
+
+static int botic_setup_serializers(struct snd_soc_dai *cpu_dai,
+        snd_pcm_format_t format, bool capture,
+        struct botic_ser_setup *ser_setup)
+{
+    struct botic_ser_config cfg;
+    unsigned int generation;
+    bool dsd = is_dsd(format);
+    u8 tx;
+    int i;
+    int ret = 0;
+
+    /* the playback and the capture link share the map */
+    mutex_lock(&botic_ser_lock);
+    cfg = botic_ser_config;
+    generation = botic_ser_generation;
+
+    if (dsd && !cfg.dsd) {
         printk(KERN_ERR "botic-card: no pins for DSD playback");
-        return -EINVAL;
+        ret = -EINVAL;
+        goto out;
     }
 
+    /* the capture keeps the PCM or DSD map of the playback */
+    if (capture && botic_ser_applied.generation != 0)
+        dsd = botic_ser_applied.dsd;
+
+    /* clear serializer setup */
+    memset(ser_setup, 0, sizeof(*ser_setup));
+
+    tx = (dsd ? cfg.dsd : cfg.pcm) | cfg.spdif;
+    for (i = 0; i < 4; i++) {
+        if (tx & BIT(i))
+            ser_setup->tx_slots[ser_setup->nch_tx++] = i;
+        if (cfg.rx & BIT(i))
+            ser_setup->rx_slots[ser_setup->nch_rx++] = i;
+    }
+
+    ser_setup->dai_fmt = cfg.spdif ? SND_SOC_DAIFMT_DIT : dai_format;
+
+    /* the serializer map is kept by the CPU DAI */
+    if (botic_ser_applied.generation == generation &&
+            botic_ser_applied.dsd == dsd)
+        goto out;
+
     ret = snd_soc_dai_set_channel_map(cpu_dai, ser_setup->nch_tx,
             ser_setup->tx_slots, ser_setup->nch_rx, ser_setup->rx_slots);
     if (ret < 0)
-        return ret;
+        goto out;
 
-    ser_setup->dai_fmt = dai_format;
-    if (n_spdif > 0) {
-#if 1
-        ser_setup->dai_fmt = SND_SOC_DAIFMT_DIT;
-#else
-        printk(KERN_ERR "botic-card: DIT is not supported dai format");
-        return -EINVAL;
-#endif
+    botic_ser_applied.generation = generation;
+    botic_ser_applied.dsd = dsd;
+
+out:
+    mutex_unlock(&botic_ser_lock);
+    return ret;
+}
+
+static const unsigned int botic_rates[] = {
+    8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000, 64000,
+    88200, 96000, 176400, 192000, 352800, 384000, 705600, 768000,
+};
+
+/* clock setup for one sample rate, derived from the module parameters */
+struct botic_clk_plan {
+    unsigned int sysclk;    /* 0 if no oscillator can produce the rate */
+    int int_osc;            /* level of int-masterclk-enable, -1 to keep */
+    int ext_switch;         /* level of ext-masterclk-switch */
+    int pcm_divisor;        /* BCLK divider for blr_ratio, 0 if unusable */
+    int dsd_divisor[3];     /* BCLK divider for DSD_U8, DSD_U16, DSD_U32 */
+};
+
+static struct botic_clk_plan botic_clk_plan[ARRAY_SIZE(botic_rates)];
+static bool botic_clk_slave;
+static DEFINE_MUTEX(botic_clk_plan_lock);
+
+/* the McASP can divide the sysclk by 1 to 32 only */
+static int botic_clk_divisor(unsigned int sysclk, unsigned int bclk)
+{
+    if (bclk == 0 || sysclk % bclk != 0)
+        return 0;
+    if (sysclk / bclk < 1 || sysclk / bclk > 32)
+        return 0;
+    return sysclk / bclk;
+}
+
+static int botic_dsd_index(snd_pcm_format_t format)
+{
+    switch (snd_pcm_format_width(format)) {
+        case 8:
+            return 0;
+        case 16:
+            return 1;
+        default:
+            return 2;
     }
+}
 
-    return 0;
+static void botic_build_clk_plan(void)
+{
+    int invert = !!(ext_masterclk & ENABLE_EXT_MASTERCLK_SWITCH_INVERT);
+    int i, j;
+
+    mutex_lock(&botic_clk_plan_lock);
+
+    botic_clk_slave = (dai_format & SND_SOC_DAIFMT_MASTER_MASK) ==
+        SND_SOC_DAIFMT_CBM_CFM;
+
+    for (i = 0; i < ARRAY_SIZE(botic_rates); i++) {
+        struct botic_clk_plan *plan = &botic_clk_plan[i];
+        unsigned int rate = botic_rates[i];
+
+        memset(plan, 0, sizeof(*plan));
+
+        if ((clk_44k1 != 0) && (clk_44k1 % rate == 0)) {
+            plan->sysclk = clk_44k1;
+            plan->int_osc = 0;
+            /* LOW for 44k1 sampling rates */
+            plan->ext_switch = invert;
+        } else if ((clk_48k != 0) && (clk_48k % rate == 0)) {
+            plan->sysclk = clk_48k;
+            /* the 44k1 clock is disabled, onboard clock can be enabled */
+            plan->int_osc = (ext_masterclk & ENABLE_EXT_MASTERCLK_48K) ?
+                -1 : 1;
+            /* HIGH for 48k sampling rates */
+            plan->ext_switch = !invert;
+        } else {
+            continue;
+        }
+
+        if (blr_ratio != 0)
+            plan->pcm_divisor = botic_clk_divisor(plan->sysclk,
+                    blr_ratio * rate);
+
+        /* DSD bit clock matches the bitrate */
+        for (j = 0; j < ARRAY_SIZE(plan->dsd_divisor); j++)
+            plan->dsd_divisor[j] = botic_clk_divisor(plan->sysclk,
+                    (8 << j) * rate);
+    }
+
+    mutex_unlock(&botic_clk_plan_lock);
 }
 
-static int botic_hw_params(struct snd_pcm_substream *substream,
-             struct snd_pcm_hw_params *params)
+/* called with botic_clk_plan_lock held */
+static bool botic_clk_plan_ok(const struct botic_clk_plan *plan,
+        snd_pcm_format_t format)
+{
+    if (botic_clk_slave)
+        return true;
+    if (plan->sysclk == 0)
+        return false;
+    if (is_dsd(format))
+        return plan->dsd_divisor[botic_dsd_index(format)] != 0;
+    /* with blr_ratio = 0 the divisor depends on the channels */
+    return blr_ratio == 0 || plan->pcm_divisor != 0;
+}
+
+static int botic_find_rate(unsigned int rate)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(botic_rates); i++)
+        if (botic_rates[i] == rate)
+            return i;
+
+    return -EINVAL;
+}
+
+static int botic_hw_rule_rate(struct snd_pcm_hw_params *params,
+        struct snd_pcm_hw_rule *rule)
+{
+    struct snd_interval *ri = hw_param_interval(params, rule->var);
+    struct snd_mask *fmt = hw_param_mask(params, SNDRV_PCM_HW_PARAM_FORMAT);
+    unsigned int list[ARRAY_SIZE(botic_rates)];
+    unsigned int count = 0;
+    int f;
+    int i;
+
+    mutex_lock(&botic_clk_plan_lock);
+    if (botic_clk_slave) {
+        mutex_unlock(&botic_clk_plan_lock);
+        return 0;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(botic_rates); i++) {
+        for (f = 0; f <= SNDRV_PCM_FORMAT_LAST; f++) {
+            if (snd_mask_test(fmt, f) &&
+                    botic_clk_plan_ok(&botic_clk_plan[i], f)) {
+                list[count++] = botic_rates[i];
+                break;
+            }
+        }
+    }
+    mutex_unlock(&botic_clk_plan_lock);
+
+    return snd_interval_list(ri, count, list, 0);
+}
+
+static int botic_hw_rule_format(struct snd_pcm_hw_params *params,
+        struct snd_pcm_hw_rule *rule)
+{
+    struct snd_interval *ri = hw_param_interval(params,
+            SNDRV_PCM_HW_PARAM_RATE);
+    struct snd_mask *fmt = hw_param_mask(params, rule->var);
+    struct snd_mask nfmt;
+    int f;
+    int i;
+
+    mutex_lock(&botic_clk_plan_lock);
+    if (botic_clk_slave) {
+        mutex_unlock(&botic_clk_plan_lock);
+        return 0;
+    }
+
+    snd_mask_none(&nfmt);
+    for (f = 0; f <= SNDRV_PCM_FORMAT_LAST; f++) {
+        if (!snd_mask_test(fmt, f))
+            continue;
+        for (i = 0; i < ARRAY_SIZE(botic_rates); i++) {
+            if (snd_interval_test(ri, botic_rates[i]) &&
+                    botic_clk_plan_ok(&botic_clk_plan[i], f)) {
+                snd_mask_set(&nfmt, f);
+                break;
+            }
+        }
+    }
+    mutex_unlock(&botic_clk_plan_lock);
+
+    return snd_mask_refine(fmt, &nfmt);
+}
+
+static struct snd_soc_card botic_card;
+
+/* let the supplies and the oscillator settle before the DAC is set up */
+#define BOTIC_WAKE_SETTLE_MS 20
+
+static struct {
+    unsigned int suspends;
+    unsigned int resumes;
+    int int_osc;            /* level of int-masterclk-enable to restore */
+    u64 last_wake_us;       /* power on to ready, including the settling */
+    u64 max_wake_us;
+} botic_pm;
+
+/* the cape is powered while a stream is open, see botic_runtime_resume() */
+static int botic_power_up(void)
 {
-    struct snd_soc_pcm_runtime *rtd = substream->private_data;
-    struct snd_soc_dai *codec_dai = rtd->codec_dai;
-    struct snd_soc_dai *cpu_dai = rtd->cpu_dai;
-    unsigned sysclk, bclk, divisor;
-    struct botic_ser_setup ser_setup;
     int ret;
 
-    snd_pcm_format_t format = params_format(params);
-    unsigned int rate = params_rate(params);
+    ret = pm_runtime_get_sync(botic_card.dev);
+    if (ret < 0) {
+        pm_runtime_put_noidle(botic_card.dev);
+        return ret;
+    }
 
-    /* setup CPU serializers */
-    ret = botic_setup_serializers(cpu_dai, format, &ser_setup);
+    return 0;
+}
+
+static void botic_shutdown(struct snd_pcm_substream *substream)
+{
+    pm_runtime_mark_last_busy(botic_card.dev);
+    pm_runtime_put_autosuspend(botic_card.dev);
+}
+
+#define BOTIC_DSD_FORMATS (\
+            SNDRV_PCM_FMTBIT_DSD_U8 | \
+            SNDRV_PCM_FMTBIT_DSD_U16_LE | \
+            SNDRV_PCM_FMTBIT_DSD_U16_BE | \
+            SNDRV_PCM_FMTBIT_DSD_U32_LE | \
+            SNDRV_PCM_FMTBIT_DSD_U32_BE | \
+            0)
+
+/* offer only the rates the oscillators can produce */
+static int botic_add_clk_rules(struct snd_pcm_runtime *runtime)
+{
+    int ret;
+
+    ret = snd_pcm_hw_rule_add(runtime, 0, SNDRV_PCM_HW_PARAM_RATE,
+            botic_hw_rule_rate, NULL, SNDRV_PCM_HW_PARAM_FORMAT, -1);
     if (ret < 0)
         return ret;
 
-    /* set codec DAI configuration */
-    ret = snd_soc_dai_set_fmt(codec_dai, ser_setup.dai_fmt);
-    if ((ret < 0) && (ret != -ENOTSUPP))
+    return snd_pcm_hw_rule_add(runtime, 0, SNDRV_PCM_HW_PARAM_FORMAT,
+            botic_hw_rule_format, NULL, SNDRV_PCM_HW_PARAM_RATE, -1);
+}
+
+static int botic_startup(struct snd_pcm_substream *substream)
+{
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    bool dsd_pins;
+    int ret;
+
+    mutex_lock(&botic_ser_lock);
+    dsd_pins = botic_ser_config.dsd != 0;
+    mutex_unlock(&botic_ser_lock);
+
+    /* do not offer DSD without serializers for it */
+    if (!dsd_pins) {
+        ret = snd_pcm_hw_constraint_mask64(runtime,
+                SNDRV_PCM_HW_PARAM_FORMAT, ~(u64)BOTIC_DSD_FORMATS);
+        if (ret < 0)
+            return ret;
+    }
+
+    ret = botic_add_clk_rules(runtime);
+    if (ret < 0)
         return ret;
 
-    /* set cpu DAI configuration */
-    ret = snd_soc_dai_set_fmt(cpu_dai, ser_setup.dai_fmt);
+    return botic_power_up();
+}
+
+static int botic_capture_startup(struct snd_pcm_substream *substream)
+{
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    bool rx_pins;
+    int ret;
+
+    mutex_lock(&botic_ser_lock);
+    rx_pins = botic_ser_config.rx != 0;
+    mutex_unlock(&botic_ser_lock);
+
+    if (!rx_pins) {
+        printk(KERN_ERR "botic-card: no pins for capture\n");
+        return -ENODEV;
+    }
+
+    ret = snd_pcm_hw_constraint_mask64(runtime,
+            SNDRV_PCM_HW_PARAM_FORMAT, ~(u64)BOTIC_DSD_FORMATS);
     if (ret < 0)
         return ret;
 
-    /* select correct clock for requested sample rate */
-    if ((clk_44k1 != 0) && (clk_44k1 % rate == 0)) {
-        sysclk = clk_44k1;
-        if (gpio_int_masterclk_enable >= 0) {
-            gpio_set_value(gpio_int_masterclk_enable, 0);
-        }
-        if (gpio_ext_masterclk_switch >= 0) {
-            /* set level to LOW for 44k1 sampling rates */
-            gpio_set_value(gpio_ext_masterclk_switch,
-                    !!(ext_masterclk & ENABLE_EXT_MASTERCLK_SWITCH_INVERT));
-        }
-    } else if (clk_48k % rate == 0) {
-        sysclk = clk_48k;
-        if (gpio_ext_masterclk_switch >= 0) {
-            /* set level to HIGH for 48k sampling rates */
-            gpio_set_value(gpio_ext_masterclk_switch,
-                    !(ext_masterclk & ENABLE_EXT_MASTERCLK_SWITCH_INVERT));
-        }
-        if ((gpio_int_masterclk_enable >= 0) &&
-                !(ext_masterclk & ENABLE_EXT_MASTERCLK_48K)) {
-            /* 44k1 clock is disabled now, we can enable onboard clock */
-            gpio_set_value(gpio_int_masterclk_enable, 1);
-        }
-    } else if ((dai_format & SND_SOC_DAIFMT_CBM_CFM) == 0) {
+    /* the external receiver clock follows the source */
+    if (!botic_capture_async) {
+        ret = botic_add_clk_rules(runtime);
+        if (ret < 0)
+            return ret;
+    }
+
+    return botic_power_up();
+}
+
+/* last clock setup applied to the hardware, GPIO levels are -1 if unknown */
+static struct botic_clk_state {
+    bool valid;
+    bool codec_valid;       /* the codec has been told the sysclk */
+    unsigned int sysclk;
+    int int_osc;
+    int ext_switch;
+    int dsd_switch;
+} botic_clk_state;
+
+static void botic_invalidate_clk_state(void)
+{
+    botic_clk_state.valid = false;
+    botic_clk_state.codec_valid = false;
+    botic_clk_state.int_osc = -1;
+    botic_clk_state.ext_switch = -1;
+    botic_clk_state.dsd_switch = -1;
+}
+
+/* returns true if the level of the GPIO has been changed */
+static bool botic_update_gpio(int gpio, int *state, int value)
+{
+    if (gpio < 0 || value < 0 || *state == value)
+        return false;
+
+    gpio_set_value(gpio, value);
+    *state = value;
+
+    return true;
+}
+
+/* take the precomputed clock setup for the requested sample rate */
+static int botic_get_clk_plan(unsigned int rate, snd_pcm_format_t format,
+        struct botic_clk_plan *plan)
+{
+    int i;
+
+    mutex_lock(&botic_clk_plan_lock);
+    i = botic_find_rate(rate);
+    if (i >= 0 && botic_clk_plan_ok(&botic_clk_plan[i], format)) {
+        *plan = botic_clk_plan[i];
+    } else if (!botic_clk_slave) {
+        mutex_unlock(&botic_clk_plan_lock);
         printk("unsupported rate %d\n", rate);
         return -EINVAL;
     } else {
-        printk("slave rate %d\n", rate);
-        sysclk = 0;
+        memset(plan, 0, sizeof(*plan));
+    }
+    mutex_unlock(&botic_clk_plan_lock);
+
+    return 0;
+}
+
+/*
+ * Select the oscillator and the DSD format switch of the plan and tell
+ * the McASP and the DAC about the master clock. Only the changes are
+ * applied, clk_changed is set if the clocks need to settle.
+ */
+static int botic_switch_clocks(struct snd_soc_dai *cpu_dai,
+        struct snd_soc_dai *codec_dai, const struct botic_clk_plan *plan,
+        snd_pcm_format_t format, bool *clk_changed)
+{
+    unsigned int sysclk = plan->sysclk;
+    int dsd_switch = -1;
+    int ret;
+
+    if (sysclk != 0) {
+        if (plan->int_osc == 0) {
+            *clk_changed |= botic_update_gpio(gpio_int_masterclk_enable,
+                    &botic_clk_state.int_osc, 0);
+        }
+        *clk_changed |= botic_update_gpio(gpio_ext_masterclk_switch,
+                &botic_clk_state.ext_switch, plan->ext_switch);
+        if (plan->int_osc == 1) {
+            *clk_changed |= botic_update_gpio(gpio_int_masterclk_enable,
+                    &botic_clk_state.int_osc, 1);
+        }
     }
 
     /* setup DSD format switch */
     if (!(dsd_format_switch & ENABLE_DSD_FORMAT_SWITCH) ||
         (gpio_dsd_format_switch < 0)) {
         /* DSD format switch is disabled or not available */
-    } else if (is_dsd(params_format(params))) {
+    } else if (!codec_dai) {
+        /* the capture leaves the switch to the playback */
+    } else if (is_dsd(format)) {
         /* DSD format switch is enabled, set level to HIGH for DSD playback */
-        gpio_set_value(gpio_dsd_format_switch,
-                !(dsd_format_switch & ENABLE_DSD_FORMAT_SWITCH_INVERT));
+        dsd_switch = !(dsd_format_switch & ENABLE_DSD_FORMAT_SWITCH_INVERT);
     } else {
         /* DSD format switch is enabled, set level to LOW for PCM playback */
-        gpio_set_value(gpio_dsd_format_switch,
-                !!(dsd_format_switch & ENABLE_DSD_FORMAT_SWITCH_INVERT));
+        dsd_switch = !!(dsd_format_switch & ENABLE_DSD_FORMAT_SWITCH_INVERT);
     }
+    *clk_changed |= botic_update_gpio(gpio_dsd_format_switch,
+            &botic_clk_state.dsd_switch, dsd_switch);
 
-    /* set the codec system clock */
-    ret = snd_soc_dai_set_sysclk(codec_dai, 0, sysclk, SND_SOC_CLOCK_IN);
-    if ((ret < 0) && (ret != -ENOTSUPP))
-        return ret;
+    if (!botic_clk_state.valid || botic_clk_state.sysclk != sysclk) {
+        /* use the external clock */
+        ret = snd_soc_dai_set_sysclk(cpu_dai, 0, sysclk, SND_SOC_CLOCK_IN);
+        if (ret < 0) {
+            printk(KERN_WARNING "botic-card: unable to set clock to CPU; ret=%d", ret);
+            goto err;
+        }
 
-    /* use the external clock */
-    ret = snd_soc_dai_set_sysclk(cpu_dai, 0, sysclk, SND_SOC_CLOCK_IN);
-    if (ret < 0) {
-        printk(KERN_WARNING "botic-card: unable to set clock to CPU; ret=%d", ret);
+        botic_clk_state.sysclk = sysclk;
+        botic_clk_state.valid = true;
+        botic_clk_state.codec_valid = false;
+        *clk_changed = true;
+    }
+
+    /* the capture may have changed the clock without the codec */
+    if (codec_dai && !botic_clk_state.codec_valid) {
+        /* set the codec system clock */
+        ret = snd_soc_dai_set_sysclk(codec_dai, 0, sysclk, SND_SOC_CLOCK_IN);
+        if ((ret < 0) && (ret != -ENOTSUPP))
+            goto err;
+
+        botic_clk_state.codec_valid = true;
+    }
+
+    return 0;
+
+err:
+    /* the clocks are in an unknown state now */
+    botic_clk_state.valid = false;
+    return ret;
+}
+
+/*
+ * Program the clocks of the DAC and the McASP for the stream. The capture
+ * link does not control the DAC, codec_dai is NULL for it.
+ */
+static int botic_clk_hw_params(struct snd_pcm_substream *substream,
+             struct snd_pcm_hw_params *params, struct snd_soc_dai *codec_dai)
+{
+    struct snd_soc_pcm_runtime *rtd = substream->private_data;
+    struct snd_soc_dai *cpu_dai = rtd->cpu_dai;
+    unsigned sysclk, bclk, divisor;
+    struct botic_ser_setup ser_setup;
+    struct botic_clk_plan plan;
+    bool clk_changed = false;
+    int ret;
+
+    snd_pcm_format_t format = params_format(params);
+    unsigned int rate = params_rate(params);
+
+    /* setup CPU serializers */
+    ret = botic_setup_serializers(cpu_dai, format, codec_dai == NULL,
+            &ser_setup);
+    if (ret < 0)
         return ret;
+
+    /* set codec DAI configuration */
+    if (codec_dai) {
+        ret = snd_soc_dai_set_fmt(codec_dai, ser_setup.dai_fmt);
+        if ((ret < 0) && (ret != -ENOTSUPP))
+            return ret;
     }
 
+    /* set cpu DAI configuration */
+    ret = snd_soc_dai_set_fmt(cpu_dai, ser_setup.dai_fmt);
+    if (ret < 0)
+        return ret;
+
+    ret = botic_get_clk_plan(rate, format, &plan);
+    if (ret < 0)
+        return ret;
+
+    sysclk = plan.sysclk;
+    if (sysclk == 0)
+        printk("slave rate %d\n", rate);
+
+    ret = botic_switch_clocks(cpu_dai, codec_dai, &plan, format,
+            &clk_changed);
+    if (ret < 0)
+        return ret;
+
     ret = snd_soc_dai_set_clkdiv(cpu_dai, 0, 1);
     if (ret < 0) {
         printk(KERN_WARNING "botic-card: unsupported set_clkdiv0");
         return ret;
     }
 
-    if ((dai_format & SND_SOC_DAIFMT_CBM_CFM) != 0) {
+    if ((dai_format & SND_SOC_DAIFMT_MASTER_MASK) == SND_SOC_DAIFMT_CBM_CFM) {
         printk("slave mode...\n");
-        return 0;
+        goto settle;
     }
 
-    switch (params_format(params)) {
-        case SNDRV_PCM_FORMAT_DSD_U8:
-            /* Clock rate for DSD matches bitrate */
-            ret = snd_soc_dai_set_clkdiv(cpu_dai, 2, 0);
-            bclk = 8 * rate;
-            break;
-
-        case SNDRV_PCM_FORMAT_DSD_U16_LE:
-        case SNDRV_PCM_FORMAT_DSD_U16_BE:
-            /* Clock rate for DSD matches bitrate */
-            ret = snd_soc_dai_set_clkdiv(cpu_dai, 2, 0);
-            bclk = 16 * rate;
-            break;
-
-        case SNDRV_PCM_FORMAT_DSD_U32_LE:
-        case SNDRV_PCM_FORMAT_DSD_U32_BE:
-            /* Clock rate for DSD matches bitrate */
-            ret = snd_soc_dai_set_clkdiv(cpu_dai, 2, 0);
-            bclk = 32 * rate;
-            break;
-
-        default:
-            /* PCM */
-            ret = snd_soc_dai_set_clkdiv(cpu_dai, 2, blr_ratio);
-            if (blr_ratio != 0) {
-                bclk = blr_ratio * rate;
-            } else {
-                bclk = snd_soc_params_to_bclk(params);
-            }
-            break;
+    if (is_dsd(format)) {
+        /* Clock rate for DSD matches bitrate */
+        ret = snd_soc_dai_set_clkdiv(cpu_dai, 2, 0);
+        divisor = plan.dsd_divisor[botic_dsd_index(format)];
+    } else {
+        /* PCM */
+        ret = snd_soc_dai_set_clkdiv(cpu_dai, 2, blr_ratio);
+        if (blr_ratio != 0) {
+            divisor = plan.pcm_divisor;
+        } else {
+            bclk = snd_soc_params_to_bclk(params);
+            divisor = (sysclk + (bclk / 2)) / bclk;
+        }
     }
     if (ret < 0) {
         printk(KERN_WARNING "botic-card: unsupported BCLK/LRCLK ratio");
         return ret;
     }
 
-    divisor = (sysclk + (bclk / 2)) / bclk;
     ret = snd_soc_dai_set_clkdiv(cpu_dai, 1, divisor);
     if (ret < 0) {
         printk(KERN_WARNING "botic-card: unsupported set_clkdiv1");
         return ret;
     }
 
-    /* Insert delay needed for enabled clocks. */
-    udelay(50);
+settle:
+    /* Insert delay needed for enabled clocks, if any changed. */
+    if (clk_changed)
+        usleep_range(50, 100);
 
     return 0;
 }
 
+/* the links share the clock state and may run hw_params concurrently */
+static DEFINE_MUTEX(botic_hw_lock);
+
+/* streams running from the oscillators, one bit per direction */
+static unsigned int botic_clk_users;
+
+/* rate and format of the next stream announced by the player */
+static struct {
+    unsigned int rate;
+    snd_pcm_format_t format;
+    bool pending;           /* not applied to the hardware yet */
+    unsigned int armed;     /* rate applied in advance, 0 if none */
+} botic_next;
+
+static struct {
+    unsigned int staged;
+    unsigned int applied;
+    unsigned int hits;      /* hw_params found the staged clocks */
+    unsigned int misses;    /* hw_params used another rate */
+    u64 last_ns;            /* duration of the last switch */
+    u64 max_ns;
+} botic_prearm_stats;
+
+/*
+ * Switch the oscillators, the DSD format switch and the DAC for the next
+ * stream while nothing is playing, the DAC relocks before the stream is
+ * opened. Called with botic_hw_lock held.
+ */
+static int botic_prearm_apply(void)
+{
+    struct snd_soc_pcm_runtime *rtd;
+    struct botic_clk_plan plan;
+    bool clk_changed = false;
+    ktime_t start;
+    u64 ns;
+    int ret;
+
+    if (!botic_next.pending || botic_clk_users)
+        return 0;
+
+    /* powered down, the oscillators are switched on the next open */
+    if (pm_runtime_suspended(botic_card.dev))
+        return 0;
+
+    rtd = snd_soc_get_pcm_runtime(&botic_card, "ExtDAC");
+    if (!rtd)
+        return -ENODEV;
+
+    botic_next.pending = false;
+
+    ret = botic_get_clk_plan(botic_next.rate, botic_next.format, &plan);
+    if (ret < 0 || plan.sysclk == 0)
+        return ret;
+
+    start = ktime_get();
+    ret = botic_switch_clocks(rtd->cpu_dai, rtd->codec_dai, &plan,
+            botic_next.format, &clk_changed);
+    if (ret < 0)
+        return ret;
+    if (clk_changed)
+        usleep_range(50, 100);
+
+    ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    botic_prearm_stats.last_ns = ns;
+    if (ns > botic_prearm_stats.max_ns)
+        botic_prearm_stats.max_ns = ns;
+    botic_prearm_stats.applied++;
+    botic_next.armed = botic_next.rate;
+
+    return 0;
+}
+
+static int botic_hw_params(struct snd_pcm_substream *substream,
+             struct snd_pcm_hw_params *params)
+{
+    struct snd_soc_pcm_runtime *rtd = substream->private_data;
+    int ret;
+
+    mutex_lock(&botic_hw_lock);
+    ret = botic_clk_hw_params(substream, params, rtd->codec_dai);
+    if (ret == 0) {
+        botic_clk_users |= BIT(substream->stream);
+
+        /* the announced stream has been set up by itself */
+        if (botic_next.pending && botic_next.rate == params_rate(params))
+            botic_next.pending = false;
+
+        if (botic_next.armed == params_rate(params))
+            botic_prearm_stats.hits++;
+        else if (botic_next.armed)
+            botic_prearm_stats.misses++;
+        botic_next.armed = 0;
+    }
+    mutex_unlock(&botic_hw_lock);
+
+    return ret;
+}
+
+static int botic_hw_free(struct snd_pcm_substream *substream)
+{
+    mutex_lock(&botic_hw_lock);
+    botic_clk_users &= ~BIT(substream->stream);
+    /* the stream has stopped, stage the clocks of the next one */
+    botic_prearm_apply();
+    mutex_unlock(&botic_hw_lock);
+
+    return 0;
+}
+
+static int botic_next_info(struct snd_kcontrol *kcontrol,
+        struct snd_ctl_elem_info *uinfo)
+{
+    uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+    uinfo->count = 2;
+    uinfo->value.integer.min = 0;
+    uinfo->value.integer.max = 768000;
+
+    return 0;
+}
+
+static int botic_next_get(struct snd_kcontrol *kcontrol,
+        struct snd_ctl_elem_value *ucontrol)
+{
+    mutex_lock(&botic_hw_lock);
+    ucontrol->value.integer.value[0] = botic_next.rate;
+    ucontrol->value.integer.value[1] = (__force int)botic_next.format;
+    mutex_unlock(&botic_hw_lock);
+
+    return 0;
+}
+
+/* value[0] is the rate, 0 to cancel, value[1] the SNDRV_PCM_FORMAT_* */
+static int botic_next_put(struct snd_kcontrol *kcontrol,
+        struct snd_ctl_elem_value *ucontrol)
+{
+    unsigned int rate = ucontrol->value.integer.value[0];
+    int format = ucontrol->value.integer.value[1];
+    int changed;
+
+    if (rate != 0 && botic_find_rate(rate) < 0)
+        return -EINVAL;
+    if (format < 0 || format > (__force int)SNDRV_PCM_FORMAT_LAST ||
+            snd_pcm_format_physical_width((__force snd_pcm_format_t)format) <= 0)
+        return -EINVAL;
+
+    mutex_lock(&botic_hw_lock);
+    changed = botic_next.rate != rate ||
+        botic_next.format != (__force snd_pcm_format_t)format;
+    botic_next.rate = rate;
+    botic_next.format = (__force snd_pcm_format_t)format;
+    botic_next.pending = rate != 0;
+    if (botic_next.pending) {
+        botic_prearm_stats.staged++;
+        /* nothing is playing, switch right away */
+        botic_prearm_apply();
+    }
+    mutex_unlock(&botic_hw_lock);
+
+    return changed;
+}
+
+static const struct snd_kcontrol_new botic_controls[] = {
+    {
+        .iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+        .name = "Next Rate Format",
+        .info = botic_next_info,
+        .get = botic_next_get,
+        .put = botic_next_put,
+    },
+};
+
+#ifdef CONFIG_DEBUG_FS
+static int botic_prearm_show(struct seq_file *s, void *unused)
+{
+    mutex_lock(&botic_hw_lock);
+    seq_printf(s, "next: %u Hz, format %d%s\n", botic_next.rate,
+            (__force int)botic_next.format,
+            botic_next.pending ? " (pending)" :
+            botic_next.armed ? " (armed)" : "");
+    seq_printf(s, "staged %u, applied %u, hits %u, misses %u\n",
+            botic_prearm_stats.staged, botic_prearm_stats.applied,
+            botic_prearm_stats.hits, botic_prearm_stats.misses);
+    seq_printf(s, "switch time: last %llu ns, max %llu ns\n",
+            botic_prearm_stats.last_ns, botic_prearm_stats.max_ns);
+    mutex_unlock(&botic_hw_lock);
+
+    return 0;
+}
+
+static int botic_prearm_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, botic_prearm_show, inode->i_private);
+}
+
+static const struct file_operations botic_prearm_fops = {
+    .open = botic_prearm_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int botic_pm_show(struct seq_file *s, void *unused)
+{
+    struct device *dev = botic_card.dev;
+
+    mutex_lock(&botic_hw_lock);
+    seq_printf(s, "state: %s, autosuspend %d ms\n",
+            pm_runtime_suspended(dev) ? "suspended" : "active",
+            dev->power.autosuspend_delay);
+    seq_printf(s, "suspends %u, resumes %u\n", botic_pm.suspends,
+            botic_pm.resumes);
+    seq_printf(s, "wake latency: last %llu us, max %llu us\n",
+            botic_pm.last_wake_us, botic_pm.max_wake_us);
+    mutex_unlock(&botic_hw_lock);
+
+    return 0;
+}
+
+static int botic_pm_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, botic_pm_show, inode->i_private);
+}
+
+static const struct file_operations botic_pm_fops = {
+    .open = botic_pm_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static void botic_init_debugfs(struct snd_soc_card *card)
+{
+    /* removed together with the card directory */
+    if (!card->debugfs_card_root)
+        return;
+
+    debugfs_create_file("prearm", 0444, card->debugfs_card_root, NULL,
+            &botic_prearm_fops);
+    debugfs_create_file("pm", 0444, card->debugfs_card_root, NULL,
+            &botic_pm_fops);
+}
+#else
+static inline void botic_init_debugfs(struct snd_soc_card *card)
+{
+}
+#endif
+
+/*
+ * The async capture runs ACLKR and AFSR from the MCLK of the receiver on
+ * the AHCLKR pin, which has to be capture_mclk_fs times the rate.
+ */
+static int botic_capture_async_hw_params(struct snd_pcm_substream *substream,
+             struct snd_pcm_hw_params *params)
+{
+    struct snd_soc_pcm_runtime *rtd = substream->private_data;
+    struct snd_soc_dai *cpu_dai = rtd->cpu_dai;
+    struct botic_ser_setup ser_setup;
+    unsigned int rate = params_rate(params);
+    unsigned int mclk, bclk;
+    int divisor;
+    int ret;
+
+    ret = botic_setup_serializers(cpu_dai, params_format(params), true,
+            &ser_setup);
+    if (ret < 0)
+        return ret;
+
+    ret = snd_soc_dai_set_fmt(cpu_dai, dai_format);
+    if (ret < 0)
+        return ret;
+
+    if (capture_mclk_fs <= 0)
+        return -EINVAL;
+
+    mclk = rate * capture_mclk_fs;
+    ret = snd_soc_dai_set_sysclk(cpu_dai, BOTIC_MCASP_SYSCLK_RX, mclk,
+            SND_SOC_CLOCK_IN);
+    if (ret < 0)
+        return ret;
+
+    if (blr_ratio != 0)
+        bclk = rate * blr_ratio;
+    else
+        bclk = snd_soc_params_to_bclk(params);
+    divisor = botic_clk_divisor(mclk, bclk);
+    if (divisor == 0) {
+        printk(KERN_ERR "botic-card: capture MCLK %u cannot produce"
+               " BCLK %u\n", mclk, bclk);
+        return -EINVAL;
+    }
+
+    return snd_soc_dai_set_clkdiv(cpu_dai, BOTIC_MCASP_CLKDIV_BCLK_RX,
+            divisor);
+}
+
+static int botic_capture_hw_params(struct snd_pcm_substream *substream,
+             struct snd_pcm_hw_params *params)
+{
+    int ret;
+
+    mutex_lock(&botic_hw_lock);
+    if (botic_capture_async) {
+        ret = botic_capture_async_hw_params(substream, params);
+    } else {
+        ret = botic_clk_hw_params(substream, params, NULL);
+        if (ret == 0)
+            botic_clk_users |= BIT(substream->stream);
+    }
+    mutex_unlock(&botic_hw_lock);
+
+    return ret;
+}
+
+static int botic_capture_init(struct snd_soc_pcm_runtime *rtd)
+{
+    if (!botic_capture_async)
+        return 0;
+
+    if (capture_mclk_fs <= 0)
+        return -EINVAL;
+
+    /* switch RX to AHCLKR before the first open, hw_params sets the rate */
+    return snd_soc_dai_set_sysclk(rtd->cpu_dai, BOTIC_MCASP_SYSCLK_RX,
+            48000 * capture_mclk_fs, SND_SOC_CLOCK_IN);
+}
+
 static struct snd_soc_ops botic_ops = {
+    .startup = botic_startup,
+    .shutdown = botic_shutdown,
     .hw_params = botic_hw_params,
+    .hw_free = botic_hw_free,
+};
+
+static struct snd_soc_ops botic_capture_ops = {
+    .startup = botic_capture_startup,
+    .shutdown = botic_shutdown,
+    .hw_params = botic_capture_hw_params,
+    .hw_free = botic_hw_free,
 };
 
 /* digital audio interface glue - connects codec <--> CPU */
-static struct snd_soc_dai_link botic_dai = {
-    .name = "ExtDAC",
-    .stream_name = "external",
-    .ops = &botic_ops,
+static struct snd_soc_dai_link botic_dai[] = {
+    {
+        .name = "ExtDAC",
+        .stream_name = "external",
+        .ops = &botic_ops,
+        .playback_only = 1,
+    },
+    {
+        /* the ADC or receiver needs no control, use the dummy codec */
+        .name = "ExtADC",
+        .stream_name = "capture",
+        .codec_name = "snd-soc-dummy",
+        .codec_dai_name = "snd-soc-dummy-dai",
+        .ops = &botic_capture_ops,
+        .init = botic_capture_init,
+        .capture_only = 1,
+    },
 };
 
 static struct snd_soc_card botic_card = {
     .name = "Botic",
     .owner = THIS_MODULE,
-    .dai_link = &botic_dai,
-    .num_links = 1,
+    .dai_link = botic_dai,
+    .num_links = ARRAY_SIZE(botic_dai),
+    .controls = botic_controls,
+    .num_controls = ARRAY_SIZE(botic_controls),
 };
 
 static int get_optional_gpio(int *optional_gpio, struct platform_device *pdev,
@@ -435,10 +1228,29 @@ static int asoc_botic_card_probe(struct platform_device *pdev)
         gpio_dsd_format_switch = -1;
     }
 
-    botic_dai.codec_of_node = of_parse_phandle(np, "audio-codec", 0);
-    if (botic_dai.codec_of_node) {
+    if (!strcmp(capture_clk, "sync")) {
+        botic_capture_async = false;
+    } else if (!strcmp(capture_clk, "ext")) {
+        /* the AHCLKR pin is a data pin in the compat pinconfig */
+        if (!strcmp(pinconfig, "compat") ||
+                (dai_format & SND_SOC_DAIFMT_MASTER_MASK) !=
+                SND_SOC_DAIFMT_CBS_CFS) {
+            dev_err(&pdev->dev, "ext capture clock needs the default"
+                    " pinconfig and the McASP as clock master\n");
+            ret = -EINVAL;
+            goto asoc_botic_card_probe_error;
+        }
+        botic_capture_async = true;
+    } else {
+        dev_err(&pdev->dev, "invalid capture_clk %s\n", capture_clk);
+        ret = -EINVAL;
+        goto asoc_botic_card_probe_error;
+    }
+
+    botic_dai[0].codec_of_node = of_parse_phandle(np, "audio-codec", 0);
+    if (botic_dai[0].codec_of_node) {
         ret = of_property_read_string_index(np, "audio-codec-dai", 0,
-                &botic_dai.codec_dai_name);
+                &botic_dai[0].codec_dai_name);
         if (ret < 0) {
             goto asoc_botic_card_probe_error;
         }
@@ -447,43 +1259,53 @@ static int asoc_botic_card_probe(struct platform_device *pdev)
         goto asoc_botic_card_probe_error;
     }
 
-    botic_dai.cpu_of_node = of_parse_phandle(np, "audio-port", 0);
-    if (!botic_dai.cpu_of_node) {
+    botic_dai[0].cpu_of_node = of_parse_phandle(np, "audio-port", 0);
+    if (!botic_dai[0].cpu_of_node) {
         ret = -ENOENT;
         goto asoc_botic_card_probe_error;
     }
 
     /* TODO */
-    botic_dai.platform_of_node = botic_dai.cpu_of_node;
+    botic_dai[0].platform_of_node = botic_dai[0].cpu_of_node;
+
+    /* the capture link uses the same McASP */
+    botic_dai[1].cpu_of_node = botic_dai[0].cpu_of_node;
+    botic_dai[1].platform_of_node = botic_dai[0].cpu_of_node;
 
     botic_card.dev = &pdev->dev;
 
+    /* the probe may have disabled some of the clocks */
+    botic_build_clk_plan();
+    botic_invalidate_clk_state();
+
+    /* serconfig set at load time has been compiled by its setter */
+    if (botic_ser_generation == 0) {
+        struct botic_ser_config cfg;
+
+        ret = botic_parse_serconfig(serconfig, &cfg);
+        if (ret < 0)
+            goto asoc_botic_card_probe_error;
+        botic_set_ser_config(&cfg);
+    }
+    botic_ser_applied.generation = 0;
+
+    /* the card is on, power it down once idle for autosuspend_ms */
+    botic_pm.int_osc = -1;
+    pm_runtime_set_active(&pdev->dev);
+    pm_runtime_set_autosuspend_delay(&pdev->dev, autosuspend_ms);
+    pm_runtime_use_autosuspend(&pdev->dev);
+    pm_runtime_mark_last_busy(&pdev->dev);
+    pm_runtime_enable(&pdev->dev);
+
     /* register card */
     ret = snd_soc_register_card(&botic_card);
     if (ret) {
         dev_err(&pdev->dev, "snd_soc_register_card failed (%d)\n", ret);
+        pm_runtime_disable(&pdev->dev);
         goto asoc_botic_card_probe_error;
     }
 
-#if 0
-    /* a hack for removing unsupported rates from the codec */
-    if (clk_44k1 == 0) {
-        botic_card.rtd[0].codec_dai->driver->playback.rates &=
-            ~(SNDRV_PCM_RATE_5512 | SNDRV_PCM_RATE_11025 |
-              SNDRV_PCM_RATE_22050 | SNDRV_PCM_RATE_44100 |
-              SNDRV_PCM_RATE_88200 | SNDRV_PCM_RATE_176400 |
-              SNDRV_PCM_RATE_352800 | SNDRV_PCM_RATE_705600 |
-              0);
-    }
-    if (clk_48k == 0) {
-        botic_card.rtd[0].codec_dai->driver->playback.rates &=
-            ~(SNDRV_PCM_RATE_8000 | SNDRV_PCM_RATE_16000 |
-              SNDRV_PCM_RATE_32000 | SNDRV_PCM_RATE_48000 |
-              SNDRV_PCM_RATE_96000 | SNDRV_PCM_RATE_192000 |
-              SNDRV_PCM_RATE_384000 | SNDRV_PCM_RATE_768000 |
-              0);
-    }
-#endif
+    botic_init_debugfs(&botic_card);
 
     dev_info(&pdev->dev, "48k %s, 44k1 %s, %s format switch\n",
             (ext_masterclk & ENABLE_EXT_MASTERCLK_48K) ? "ext" : (
@@ -521,6 +1343,9 @@ static int asoc_botic_card_remove(struct platform_device *pdev)
 
     snd_soc_unregister_card(card);
 
+    pm_runtime_dont_use_autosuspend(&pdev->dev);
+    pm_runtime_disable(&pdev->dev);
+
     if (gpio_int_masterclk_enable >= 0) {
         /* switch the oscillator off first */
         gpio_set_value(gpio_int_masterclk_enable, 0);
@@ -551,31 +1376,109 @@ static void asoc_botic_card_shutdown(struct platform_device *pdev)
     }
 }
 
-#ifdef CONFIG_PM_SLEEP
-static int asoc_botic_card_suspend(struct platform_device *pdev, pm_message_t state)
+#ifdef CONFIG_PM
+/*
+ * The codec registers go with the cape power, the codec keeps them in its
+ * cache while the cape is off and restores them when it is on again.
+ */
+static void botic_codec_power(bool on)
 {
-    if (gpio_card_power_switch >= 0) {
-        /* switch the card off before going suspend */
+    struct snd_soc_pcm_runtime *rtd;
+
+    rtd = snd_soc_get_pcm_runtime(&botic_card, "ExtDAC");
+    if (rtd == NULL)
+        return;
+
+    if (on)
+        sabre32_power_on(rtd->codec);
+    else
+        sabre32_power_off(rtd->codec);
+}
+
+static int botic_runtime_suspend(struct device *dev)
+{
+    mutex_lock(&botic_hw_lock);
+
+    botic_codec_power(false);
+
+    /* remembered for the resume, the oscillator is off meanwhile */
+    botic_pm.int_osc = botic_clk_state.int_osc;
+    if (gpio_int_masterclk_enable >= 0)
+        gpio_set_value(gpio_int_masterclk_enable, 0);
+    if (gpio_card_power_switch >= 0)
         gpio_set_value(gpio_card_power_switch, 0);
-    }
+    botic_invalidate_clk_state();
+    botic_pm.suspends++;
+
+    mutex_unlock(&botic_hw_lock);
 
     return 0;
 }
 
-static int asoc_botic_card_resume(struct platform_device *pdev)
+static int botic_runtime_resume(struct device *dev)
 {
-    if (gpio_card_power_switch >= 0) {
-        /* switch the card on after resuming from suspend */
+    ktime_t start = ktime_get();
+    u64 us;
+
+    mutex_lock(&botic_hw_lock);
+
+    /* power and oscillator come up together, one settling time for both */
+    if (gpio_card_power_switch >= 0)
         gpio_set_value(gpio_card_power_switch, 1);
-    }
+    botic_update_gpio(gpio_int_masterclk_enable, &botic_clk_state.int_osc,
+            botic_pm.int_osc);
+    msleep(BOTIC_WAKE_SETTLE_MS);
+
+    /* the DAC is ready to play once its registers are back */
+    botic_codec_power(true);
+
+    us = ktime_us_delta(ktime_get(), start);
+    botic_pm.last_wake_us = us;
+    if (us > botic_pm.max_wake_us)
+        botic_pm.max_wake_us = us;
+    botic_pm.resumes++;
+
+    mutex_unlock(&botic_hw_lock);
 
     return 0;
 }
-#else
-#define asoc_botic_card_suspend NULL
-#define asoc_botic_card_resume NULL
 #endif
 
+#ifdef CONFIG_PM_SLEEP
+static int asoc_botic_card_suspend(struct device *dev)
+{
+    int ret;
+
+    ret = snd_soc_suspend(dev);
+    if (ret)
+        return ret;
+
+    /* switch the card off before going suspend, unless it is off already */
+    return pm_runtime_force_suspend(dev);
+}
+
+static int asoc_botic_card_resume(struct device *dev)
+{
+    int ret;
+
+    /* switch the card on before the codec and the streams resume */
+    ret = pm_runtime_force_resume(dev);
+    if (ret)
+        return ret;
+
+    /* the autosuspend switches it off again if no stream is open */
+    pm_runtime_mark_last_busy(dev);
+    pm_request_autosuspend(dev);
+
+    return snd_soc_resume(dev);
+}
+#endif
+
+static const struct dev_pm_ops asoc_botic_card_pm_ops = {
+    SET_SYSTEM_SLEEP_PM_OPS(asoc_botic_card_suspend, asoc_botic_card_resume)
+    SET_RUNTIME_PM_OPS(botic_runtime_suspend, botic_runtime_resume, NULL)
+};
+
 #if defined(CONFIG_OF)
 static const struct of_device_id asoc_botic_card_dt_ids[] = {
     { .compatible = "botic-audio-card" },
@@ -589,11 +1492,10 @@ static struct platform_driver asoc_botic_card_driver = {
     .probe = asoc_botic_card_probe,
     .remove = asoc_botic_card_remove,
     .shutdown = asoc_botic_card_shutdown,
-    .suspend = asoc_botic_card_suspend,
-    .resume = asoc_botic_card_resume,
     .driver = {
         .name = "asoc-botic-card",
         .of_match_table = of_match_ptr(asoc_botic_card_dt_ids),
+        .pm = &asoc_botic_card_pm_ops,
     },
 };
 
@@ -608,21 +1510,125 @@ MODULE_PARM_DESC(ext_masterclk, "available external masterclocks");
 module_param(dsd_format_switch, int, 0444);
 MODULE_PARM_DESC(dsd_format_switch, "mode of dsd format switch");
 
-module_param(serconfig, charp, 0644);
+/* rebuild the clock plan whenever one of its inputs changes */
+static int botic_param_set_clk(const char *val, const struct kernel_param *kp)
+{
+    int ret;
+
+    ret = param_set_int(val, kp);
+    if (ret < 0)
+        return ret;
+
+    botic_build_clk_plan();
+
+    return 0;
+}
+
+static const struct kernel_param_ops botic_clk_param_ops = {
+    .set = botic_param_set_clk,
+    .get = param_get_int,
+};
+
+static int botic_param_set_serconfig(const char *val,
+        const struct kernel_param *kp)
+{
+    struct botic_ser_config cfg;
+    int ret;
+
+    ret = botic_parse_serconfig(val, &cfg);
+    if (ret < 0)
+        return ret;
+
+    ret = param_set_charp(val, kp);
+    if (ret < 0)
+        return ret;
+
+    botic_set_ser_config(&cfg);
+
+    return 0;
+}
+
+static const struct kernel_param_ops botic_serconfig_param_ops = {
+    .set = botic_param_set_serconfig,
+    .get = param_get_charp,
+    .free = param_free_charp,
+};
+
+module_param_cb(serconfig, &botic_serconfig_param_ops, &serconfig, 0644);
 MODULE_PARM_DESC(serconfig, "serializer configuration");
 
-module_param(dai_format, int, 0644);
+static int botic_param_set_dai_format(const char *val,
+        const struct kernel_param *kp)
+{
+    int fmt;
+    int ret;
+
+    ret = kstrtoint(val, 0, &fmt);
+    if (ret < 0)
+        return ret;
+
+    switch (fmt & SND_SOC_DAIFMT_FORMAT_MASK) {
+        case SND_SOC_DAIFMT_I2S:
+        case SND_SOC_DAIFMT_RIGHT_J:
+        case SND_SOC_DAIFMT_LEFT_J:
+        case SND_SOC_DAIFMT_DSP_A:
+        case SND_SOC_DAIFMT_DSP_B:
+            break;
+        default:
+            printk(KERN_ERR "botic-card: unsupported dai_format 0x%x\n", fmt);
+            return -EINVAL;
+    }
+
+    switch (fmt & SND_SOC_DAIFMT_INV_MASK) {
+        case SND_SOC_DAIFMT_NB_NF:
+        case SND_SOC_DAIFMT_NB_IF:
+        case SND_SOC_DAIFMT_IB_NF:
+        case SND_SOC_DAIFMT_IB_IF:
+            break;
+        default:
+            printk(KERN_ERR "botic-card: unsupported dai_format 0x%x\n", fmt);
+            return -EINVAL;
+    }
+
+    /* the clock plan knows the McASP as clock master or slave only */
+    switch (fmt & SND_SOC_DAIFMT_MASTER_MASK) {
+        case SND_SOC_DAIFMT_CBM_CFM:
+        case SND_SOC_DAIFMT_CBS_CFS:
+            break;
+        default:
+            printk(KERN_ERR "botic-card: unsupported dai_format 0x%x\n", fmt);
+            return -EINVAL;
+    }
+
+    return botic_param_set_clk(val, kp);
+}
+
+static const struct kernel_param_ops botic_dai_format_param_ops = {
+    .set = botic_param_set_dai_format,
+    .get = param_get_int,
+};
+
+module_param_cb(dai_format, &botic_dai_format_param_ops, &dai_format, 0644);
 MODULE_PARM_DESC(dai_format, "output format and clock sources configuration");
 
-module_param(clk_44k1, int, 0644);
+module_param_cb(clk_44k1, &botic_clk_param_ops, &clk_44k1, 0644);
 MODULE_PARM_DESC(clk_44k1, "frequency of crystal for 44k1 modes");
 
-module_param(clk_48k, int, 0644);
+module_param_cb(clk_48k, &botic_clk_param_ops, &clk_48k, 0644);
 MODULE_PARM_DESC(clk_48k, "frequency of crystal for 48k modes");
 
-module_param(blr_ratio, int, 0644);
+module_param_cb(blr_ratio, &botic_clk_param_ops, &blr_ratio, 0644);
 MODULE_PARM_DESC(blr_ratio, "force BCLK/LRCLK ratio");
 
+module_param(autosuspend_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_ms, "power the cape down when idle for this many ms (-1 never)");
+
+module_param(capture_clk, charp, 0444);
+MODULE_PARM_DESC(capture_clk, "capture clock: sync (playback clocks) or ext (MCLK on AHCLKR)");
+
+module_param(capture_mclk_fs, int, 0644);
+MODULE_PARM_DESC(capture_mclk_fs, "ratio of the external capture MCLK to the sample rate");
+
 MODULE_AUTHOR("Miroslav Rudisin");
 MODULE_DESCRIPTION("ASoC Botic sound card");
 MODULE_LICENSE("GPL");
@@ -0,0 +1,79 @@
+/*
+ * ESS Technology Sabre32 family Audio DAC support, i2c trace events
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sabre32
+
+#if !defined(_SABRE32_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SABRE32_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* an ALSA operation starts its i2c transfers */
+TRACE_EVENT(sabre32_io_start,
+    TP_PROTO(const char *op),
+    TP_ARGS(op),
+    TP_STRUCT__entry(
+        __string(op, op)
+    ),
+    TP_fast_assign(
+        __assign_str(op, op);
+    ),
+    TP_printk("%s", __get_str(op))
+);
+
+/* the operation has finished, with the totals of its transfers */
+TRACE_EVENT(sabre32_io_done,
+    TP_PROTO(const char *op, unsigned int xfers, unsigned int bytes, u64 us),
+    TP_ARGS(op, xfers, bytes, us),
+    TP_STRUCT__entry(
+        __string(op, op)
+        __field(unsigned int, xfers)
+        __field(unsigned int, bytes)
+        __field(u64, us)
+    ),
+    TP_fast_assign(
+        __assign_str(op, op);
+        __entry->xfers = xfers;
+        __entry->bytes = bytes;
+        __entry->us = us;
+    ),
+    TP_printk("%s xfers=%u bytes=%u us=%llu", __get_str(op),
+        __entry->xfers, __entry->bytes, (unsigned long long)__entry->us)
+);
+
+/* one i2c transfer of a chip */
+TRACE_EVENT(sabre32_io_xfer,
+    TP_PROTO(unsigned short addr, bool read, unsigned int bytes, u64 us,
+        int ret),
+    TP_ARGS(addr, read, bytes, us, ret),
+    TP_STRUCT__entry(
+        __field(unsigned short, addr)
+        __field(bool, read)
+        __field(unsigned int, bytes)
+        __field(u64, us)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->addr = addr;
+        __entry->read = read;
+        __entry->bytes = bytes;
+        __entry->us = us;
+        __entry->ret = ret;
+    ),
+    TP_printk("0x%02x %s bytes=%u us=%llu ret=%d", __entry->addr,
+        __entry->read ? "read" : "write", __entry->bytes,
+        (unsigned long long)__entry->us, __entry->ret)
+);
+
+#endif /* _SABRE32_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sabre32-trace
+#include <trace/define_trace.h>
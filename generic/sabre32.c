@@ -27,10 +27,149 @@
 #include <linux/delay.h>
 
 #include <linux/of_gpio.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+
+#include "sabre32.h"
+
+#define CREATE_TRACE_POINTS
+#include "sabre32-trace.h"
 
 #define SABRE32_CODEC_NAME "sabre32-codec"
 #define SABRE32_CODEC_DAI_NAME "sabre32-hifi"
 
+/* 0x48 and, on dual mono boards, 0x49 */
+#define SABRE32_CHIPS 2
+
+/* volume steps per ramp step (0 = no ramp) and the time between steps */
+static unsigned int volume_ramp_step = 4;
+static unsigned int volume_ramp_ms = 2;
+
+/*
+ * DPLL lock polling after a relock or a trigger, backing off to the slow
+ * interval while the lock is stable
+ */
+#define SABRE32_LOCK_POLL_MS 2
+#define SABRE32_LOCK_SLOW_POLL_MS 1000
+#define SABRE32_LOCK_TIMEOUT_MS 1000
+
+/* duration of the master trim transfers */
+struct sabre32_trim_stats {
+    unsigned int writes;
+    unsigned int errors;
+    u64 last_us;
+    u64 max_us;
+};
+
+/*
+ * Volume changes are applied by a worker which moves the master trim
+ * towards the target in volume_ramp_step steps. A new target replaces the
+ * previous one, a running ramp just changes its direction.
+ */
+struct sabre32_ramp {
+    struct mutex lock; /* the ramp and the trim registers */
+    struct delayed_work work;
+    unsigned int current_step; /* applied volume step */
+    unsigned int target;
+    bool running;
+    ktime_t start;
+    unsigned int count;
+    unsigned int merged;
+    u64 last_us;
+    u64 max_us;
+};
+
+/* time from a forced DPLL relock to the DAC reporting the lock */
+struct sabre32_relock_stats {
+    unsigned int count;
+    unsigned int timeouts;
+    bool pending;
+    bool locked;
+    ktime_t start;
+    u64 last_us;
+    u64 max_us;
+};
+
+/*
+ * i2c accounting: the transfers are charged to the ALSA operation running
+ * in the same task, see sabre32_io_begin(). Controls are charged by their
+ * virtual register, see sabre32_codec_read().
+ */
+/* virtual registers of the mixer controls, see sabre32_codec_read() */
+#define SABRE32_CTL_REGS 28
+
+enum {
+    SABRE32_IO_OTHER = 0,
+    SABRE32_IO_PROBE,
+    SABRE32_IO_SET_FMT,
+    SABRE32_IO_MUTE_STREAM,
+    SABRE32_IO_HW_PARAMS,
+    SABRE32_IO_SET_SYSCLK,
+    SABRE32_IO_LOCK_MONITOR,
+    SABRE32_IO_RAMP,
+    SABRE32_IO_RESUME,
+    SABRE32_IO_CTL_READ,
+    SABRE32_IO_CTL_WRITE = SABRE32_IO_CTL_READ + SABRE32_CTL_REGS,
+    SABRE32_IO_NUM = SABRE32_IO_CTL_WRITE + SABRE32_CTL_REGS,
+};
+
+/* operations of different tasks running at the same time */
+#define SABRE32_IO_SLOTS 4
+
+struct sabre32_io_stats {
+    unsigned int calls; /* operations with at least one transfer */
+    unsigned int xfers;
+    unsigned int errors;
+    u64 bytes;
+    u64 total_us;
+    u64 max_us; /* bus time of one operation */
+};
+
+struct sabre32_io_slot {
+    struct task_struct *task;
+    int op;
+    int depth; /* nested operations are charged to the outer one */
+    unsigned int xfers;
+    unsigned int bytes;
+    u64 us;
+};
+
+/* regmap bus context of a chip */
+struct sabre32_bus {
+    struct sabre32_codec_data *codec_data;
+    struct i2c_client *client;
+};
+
+/* restoring the registers after the cape power returns */
+struct sabre32_resume_stats {
+    unsigned int count;
+    unsigned int errors;
+    u64 last_us;
+    u64 max_us;
+};
+
+/* DPLL state seen while a stream is running */
+struct sabre32_dpll_monitor {
+    spinlock_t lock; /* running and trigger, set from the trigger */
+    bool running;
+    bool trigger_pending; /* time to lock not measured yet */
+    ktime_t trigger;
+    bool locked;
+    unsigned int rate; /* detected, 0 if unknown */
+    unsigned int interval_ms;
+    unsigned int unlocks;
+    unsigned int recoveries;
+    u64 lock_us; /* from the trigger */
+    u64 max_lock_us;
+    struct snd_kcontrol *locked_ctl;
+    struct snd_kcontrol *rate_ctl;
+};
+
 struct sabre32_codec_data {
     struct i2c_adapter *i2c_adapter;
     struct i2c_client *i2c_client1;
@@ -44,6 +183,22 @@ struct sabre32_codec_data {
     unsigned int external_volume;
     int external_mute;
     int last_clock_48k;
+    struct snd_soc_codec *codec;
+    unsigned int dac_clk; /* DAC master clock from DT, else the sysclk */
+    unsigned int sysclk;
+    struct sabre32_relock_stats relock;
+    struct sabre32_dpll_monitor dpll;
+    struct delayed_work lock_work;
+    struct sabre32_trim_stats trim;
+    struct sabre32_ramp ramp;
+    unsigned int mirror_errors;
+    struct sabre32_resume_stats resume;
+    struct mutex power_lock;
+    int power_off; /* the card or system sleep has the DAC off */
+    struct sabre32_bus bus[SABRE32_CHIPS];
+    spinlock_t io_lock; /* io_slots and io_stats */
+    struct sabre32_io_slot io_slots[SABRE32_IO_SLOTS];
+    struct sabre32_io_stats io_stats[SABRE32_IO_NUM];
 };
 
 #define SABRE32_RATES (\
@@ -214,6 +369,36 @@ static SOC_ENUM_SINGLE_DECL(remap_output, 14, 0, remap_output_text);
 static const DECLARE_TLV_DB_MINMAX_MUTE(master_tlv, -6051, 0);
 static const DECLARE_TLV_DB_MINMAX(dac_tlv, -12750, 0);
 
+static int sabre32_dpll_locked_get(struct snd_kcontrol *kcontrol,
+        struct snd_ctl_elem_value *ucontrol)
+{
+    struct snd_soc_codec *codec = snd_soc_kcontrol_codec(kcontrol);
+    struct sabre32_codec_data *codec_data = snd_soc_codec_get_drvdata(codec);
+
+    ucontrol->value.integer.value[0] = READ_ONCE(codec_data->dpll.locked);
+    return 0;
+}
+
+static int sabre32_detected_rate_info(struct snd_kcontrol *kcontrol,
+        struct snd_ctl_elem_info *uinfo)
+{
+    uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+    uinfo->count = 1;
+    uinfo->value.integer.min = 0;
+    uinfo->value.integer.max = INT_MAX;
+    return 0;
+}
+
+static int sabre32_detected_rate_get(struct snd_kcontrol *kcontrol,
+        struct snd_ctl_elem_value *ucontrol)
+{
+    struct snd_soc_codec *codec = snd_soc_kcontrol_codec(kcontrol);
+    struct sabre32_codec_data *codec_data = snd_soc_codec_get_drvdata(codec);
+
+    ucontrol->value.integer.value[0] = READ_ONCE(codec_data->dpll.rate);
+    return 0;
+}
+
 static const struct snd_kcontrol_new sabre32_codec_controls[] = {
     SOC_DOUBLE_TLV("Master Playback Volume", 0, 0, 0, VOLUME_MAXATTEN, 1,
             master_tlv),
@@ -241,109 +426,536 @@ static const struct snd_kcontrol_new sabre32_codec_controls[] = {
     SOC_SINGLE_TLV("DAC6 Playback Volume", 25, 0, 255, 1, dac_tlv),
     SOC_SINGLE_TLV("DAC7 Playback Volume", 26, 0, 255, 1, dac_tlv),
     SOC_SINGLE_TLV("DAC8 Playback Volume", 27, 0, 255, 1, dac_tlv),
+    /* updated by the lock monitor, notified on change */
+    {
+        .iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+        .name = "DPLL Locked",
+        .access = SNDRV_CTL_ELEM_ACCESS_READ |
+            SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+        .info = snd_ctl_boolean_mono_info,
+        .get = sabre32_dpll_locked_get,
+    },
+    {
+        .iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+        .name = "Detected Rate",
+        .access = SNDRV_CTL_ELEM_ACCESS_READ |
+            SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+        .info = sabre32_detected_rate_info,
+        .get = sabre32_detected_rate_get,
+    },
+};
+
+/* 32-bit master trim, LSB first */
+#define SABRE32_REG_MASTER_TRIM 20
+/* True Mono and the DPLL relock */
+#define SABRE32_REG_MODE 17
+#define SABRE32_MONO_ENABLE 0x01
+#define SABRE32_MONO_RIGHT 0x80
+/* registers 27-31 are the read-only status and DPLL ratio */
+#define SABRE32_REG_STATUS 27
+#define SABRE32_REG_DPLL_NUM 28
+#define SABRE32_MAX_REGISTER 72
+
+static const char * const sabre32_io_names[] = {
+    [SABRE32_IO_OTHER] = "other",
+    [SABRE32_IO_PROBE] = "probe",
+    [SABRE32_IO_SET_FMT] = "set_fmt",
+    [SABRE32_IO_MUTE_STREAM] = "mute_stream",
+    [SABRE32_IO_HW_PARAMS] = "hw_params",
+    [SABRE32_IO_SET_SYSCLK] = "set_sysclk",
+    [SABRE32_IO_LOCK_MONITOR] = "lock monitor",
+    [SABRE32_IO_RAMP] = "volume ramp",
+    [SABRE32_IO_RESUME] = "resume",
 };
 
-static const struct regmap_config empty_regmap_config;
+/* names of the virtual registers of the controls */
+static const char * const sabre32_io_ctl_names[SABRE32_CTL_REGS] = {
+    "Master Volume", "Master Switch", "SPDIF Source", "Jitter Reduction",
+    "De-emphasis Filter", "DPLL", "IIR Bandwidth", "FIR Rolloff",
+    "True Mono", "DPLL Phase", "Oversampling Filter", NULL,
+    "Remap Inputs", "MCLK Notch", "Remap Output", "External Volume",
+    "External Switch", NULL, NULL, NULL,
+    "DAC1 Volume", "DAC2 Volume", "DAC3 Volume", "DAC4 Volume",
+    "DAC5 Volume", "DAC6 Volume", "DAC7 Volume", "DAC8 Volume",
+};
 
-static int sabre32_codec_probe(struct snd_soc_codec *codec)
+static const char *sabre32_io_name(int op, char *buf, size_t size)
 {
-    struct sabre32_codec_data *codec_data = snd_soc_codec_get_drvdata(codec);
-    struct regmap_config config;
+    const char *ctl;
+
+    if (op < SABRE32_IO_CTL_READ)
+        return sabre32_io_names[op];
+
+    ctl = sabre32_io_ctl_names[(op - SABRE32_IO_CTL_READ) % SABRE32_CTL_REGS];
+    snprintf(buf, size, "%s %s", ctl ? ctl : "?",
+            op < SABRE32_IO_CTL_WRITE ? "get" : "put");
+    return buf;
+}
+
+/* Called with io_lock held. */
+static struct sabre32_io_slot *sabre32_io_slot(
+        struct sabre32_codec_data *codec_data, struct task_struct *task)
+{
+    int i;
+
+    for (i = 0; i < SABRE32_IO_SLOTS; i++)
+        if (codec_data->io_slots[i].task == task)
+            return &codec_data->io_slots[i];
+
+    return NULL;
+}
+
+static void sabre32_io_begin(struct sabre32_codec_data *codec_data, int op)
+{
+    struct sabre32_io_slot *slot;
+    bool first = false;
+    char buf[32];
+
+    spin_lock(&codec_data->io_lock);
+    slot = sabre32_io_slot(codec_data, current);
+    if (slot == NULL) {
+        /* not charged if all slots are taken */
+        slot = sabre32_io_slot(codec_data, NULL);
+        if (slot != NULL) {
+            memset(slot, 0, sizeof(*slot));
+            slot->task = current;
+            slot->op = op;
+        }
+    }
+    if (slot != NULL)
+        first = ++slot->depth == 1;
+    spin_unlock(&codec_data->io_lock);
+
+    /* the name is formatted before the tracepoint checks its key */
+    if (first && trace_sabre32_io_start_enabled())
+        trace_sabre32_io_start(sabre32_io_name(op, buf, sizeof(buf)));
+}
+
+static void sabre32_io_end(struct sabre32_codec_data *codec_data)
+{
+    struct sabre32_io_slot *slot, done;
+    struct sabre32_io_stats *stats;
+    char buf[32];
+
+    spin_lock(&codec_data->io_lock);
+    slot = sabre32_io_slot(codec_data, current);
+    if (slot == NULL || --slot->depth > 0) {
+        spin_unlock(&codec_data->io_lock);
+        return;
+    }
+
+    done = *slot;
+    slot->task = NULL;
+    stats = &codec_data->io_stats[done.op];
+    if (done.xfers) {
+        stats->calls++;
+        if (done.us > stats->max_us)
+            stats->max_us = done.us;
+    }
+    spin_unlock(&codec_data->io_lock);
+
+    if (trace_sabre32_io_done_enabled())
+        trace_sabre32_io_done(sabre32_io_name(done.op, buf, sizeof(buf)),
+                done.xfers, done.bytes, done.us);
+}
+
+static void sabre32_io_account(struct sabre32_bus *bus, bool read,
+        size_t bytes, ktime_t start, int ret)
+{
+    struct sabre32_codec_data *codec_data = bus->codec_data;
+    u64 us = ktime_us_delta(ktime_get(), start);
+    struct sabre32_io_stats *stats;
+    struct sabre32_io_slot *slot;
+
+    spin_lock(&codec_data->io_lock);
+    slot = sabre32_io_slot(codec_data, current);
+    stats = &codec_data->io_stats[slot ? slot->op : SABRE32_IO_OTHER];
+    stats->xfers++;
+    stats->bytes += bytes;
+    stats->total_us += us;
+    if (ret)
+        stats->errors++;
+    if (slot != NULL) {
+        slot->xfers++;
+        slot->bytes += bytes;
+        slot->us += us;
+    }
+    spin_unlock(&codec_data->io_lock);
+
+    trace_sabre32_io_xfer(bus->client->addr, read, bytes, us, ret);
+}
+
+/* The regmap i2c bus, with the accounting of each transfer. */
+static int sabre32_bus_write(void *context, const void *data, size_t count)
+{
+    struct sabre32_bus *bus = context;
+    ktime_t start = ktime_get();
     int ret;
 
-    if (codec_data->i2c_adapter == NULL)
-        return 0;
+    ret = i2c_master_send(bus->client, data, count);
+    if (ret == count)
+        ret = 0;
+    else if (ret >= 0)
+        ret = -EIO;
 
-    codec_data->i2c_client1 = i2c_new_dummy(codec_data->i2c_adapter, 0x48);
-    if (codec_data->i2c_client1 == NULL)
-        return -EBUSY;
+    sabre32_io_account(bus, false, count, start, ret);
 
-    codec_data->i2c_client2 = i2c_new_dummy(codec_data->i2c_adapter, 0x49);
-    if (codec_data->i2c_client1 == NULL) {
-        i2c_unregister_device(codec_data->i2c_client1);
-        return -EBUSY;
+    return ret;
+}
+
+static int sabre32_bus_gather_write(void *context,
+        const void *reg, size_t reg_size, const void *val, size_t val_size)
+{
+    u8 *buf;
+    int ret;
+
+    buf = kmalloc(reg_size + val_size, GFP_KERNEL);
+    if (buf == NULL)
+        return -ENOMEM;
+
+    memcpy(buf, reg, reg_size);
+    memcpy(buf + reg_size, val, val_size);
+    ret = sabre32_bus_write(context, buf, reg_size + val_size);
+    kfree(buf);
+
+    return ret;
+}
+
+static int sabre32_bus_read(void *context,
+        const void *reg, size_t reg_size, void *val, size_t val_size)
+{
+    struct sabre32_bus *bus = context;
+    struct i2c_msg xfer[2] = {
+        {
+            .addr = bus->client->addr,
+            .len = reg_size,
+            .buf = (void *)reg,
+        },
+        {
+            .addr = bus->client->addr,
+            .flags = I2C_M_RD,
+            .len = val_size,
+            .buf = val,
+        },
+    };
+    ktime_t start = ktime_get();
+    int ret;
+
+    ret = i2c_transfer(bus->client->adapter, xfer, ARRAY_SIZE(xfer));
+    if (ret == ARRAY_SIZE(xfer))
+        ret = 0;
+    else if (ret >= 0)
+        ret = -EIO;
+
+    sabre32_io_account(bus, true, reg_size + val_size, start, ret);
+
+    return ret;
+}
+
+static const struct regmap_bus sabre32_regmap_bus = {
+    .write = sabre32_bus_write,
+    .gather_write = sabre32_bus_gather_write,
+    .read = sabre32_bus_read,
+};
+
+static bool sabre32_volatile_reg(struct device *dev, unsigned int reg)
+{
+    return reg >= SABRE32_REG_STATUS && reg <= SABRE32_REG_DPLL_NUM + 3;
+}
+
+/*
+ * ES9018 power-on values from the datasheet, a cache sync after a power
+ * cycle writes only the registers differing from them. The chip is not
+ * read for the defaults, at probe time it may hold the settings of a
+ * previous session (module reload, warm reboot). Registers without an
+ * entry are always written by the sync.
+ */
+static const struct reg_default sabre32_reg_defaults[] = {
+    { 0, 0x00 },    /* attenuation DAC1..8 */
+    { 1, 0x00 },
+    { 2, 0x00 },
+    { 3, 0x00 },
+    { 4, 0x00 },
+    { 5, 0x00 },
+    { 6, 0x00 },
+    { 7, 0x00 },
+    { 8, 0x68 },    /* automute level */
+    { 9, 0x04 },    /* automute time */
+    { 10, 0xce },   /* mode control 1 */
+    { 11, 0x85 },   /* mode control 2 */
+    { SABRE32_REG_MODE, 0x1c },
+    { 18, 0x01 },   /* SPDIF source */
+    { SABRE32_REG_MASTER_TRIM, 0xff },
+    { SABRE32_REG_MASTER_TRIM + 1, 0xff },
+    { SABRE32_REG_MASTER_TRIM + 2, 0xff },
+    { SABRE32_REG_MASTER_TRIM + 3, 0x7f },
+};
+
+/*
+ * The registers are cached on their first read or write, the mixer
+ * controls do not touch the bus after that.
+ */
+static const struct regmap_config sabre32_regmap_config = {
+    .reg_bits = 8,
+    .val_bits = 8,
+    .max_register = SABRE32_MAX_REGISTER,
+    .volatile_reg = sabre32_volatile_reg,
+    .reg_defaults = sabre32_reg_defaults,
+    .num_reg_defaults = ARRAY_SIZE(sabre32_reg_defaults),
+    .cache_type = REGCACHE_RBTREE,
+};
+
+/*
+ * The cache starts from the power-on values, put a chip which kept the
+ * settings of a previous session into the same state. The mute bit of
+ * mode control 1 has been set already.
+ */
+static int sabre32_write_defaults(struct regmap *client)
+{
+    int i, ret;
+
+    for (i = 0; i < ARRAY_SIZE(sabre32_reg_defaults); i++) {
+        const struct reg_default *def = &sabre32_reg_defaults[i];
+
+        if (def->reg == 10)
+            continue;
+        ret = regmap_write(client, def->reg, def->def);
+        if (ret)
+            return ret;
     }
 
-    /* ES9018 DAC */
-    config = empty_regmap_config;
-    config.val_bits = 8;
-    config.reg_bits = 8;
-    config.max_register = 72;
+    return 0;
+}
+
+static struct regmap *sabre32_chip(struct sabre32_codec_data *codec_data,
+        int chip)
+{
+    return chip == 0 ? codec_data->client1 : codec_data->client2;
+}
+
+/* iterate over the present chips, the first one is the reference */
+#define sabre32_for_each_chip(codec_data, chip, client) \
+    for (chip = 0; chip < SABRE32_CHIPS; chip++) \
+        if ((client = sabre32_chip(codec_data, chip)) != NULL)
 
-    codec_data->client1 =
-        devm_regmap_init_i2c(codec_data->i2c_client1, &config);
+/*
+ * The second chip of a dual mono board plays the other channel: the True
+ * Mono channel select is swapped whenever True Mono is enabled.
+ */
+static unsigned int sabre32_chip_val(int chip, unsigned int reg,
+        unsigned int mask, unsigned int val)
+{
+    if (chip == 1 && reg == SABRE32_REG_MODE && (mask & SABRE32_MONO_RIGHT)
+            && (val & SABRE32_MONO_ENABLE))
+        val ^= SABRE32_MONO_RIGHT;
 
-    codec_data->client2 =
-        devm_regmap_init_i2c(codec_data->i2c_client2, &config);
+    return val;
+}
 
-    /* Mute DAC */
+/*
+ * Configuration changes go to every present chip, one register at a time
+ * so that the chips never differ for longer than one i2c transfer. The
+ * register cache drops the writes not changing a chip.
+ */
+static int sabre32_update_bits(struct sabre32_codec_data *codec_data,
+        unsigned int reg, unsigned int mask, unsigned int val)
+{
+    struct regmap *client;
+    int chip;
+    int ret = 0;
 
-    ret = regmap_update_bits(codec_data->client1, 10, 0x01, 0x01);
-    if (ret != 0) {
-        dev_warn(codec->dev, "DAC#1 not found\n");
-        i2c_unregister_device(codec_data->i2c_client1);
-        codec_data->i2c_client1 = NULL;
+    sabre32_for_each_chip(codec_data, chip, client) {
+        int r = regmap_update_bits(client, reg, mask,
+                sabre32_chip_val(chip, reg, mask, val));
+
+        if (r) {
+            codec_data->mirror_errors++;
+            if (!ret)
+                ret = r;
+        }
     }
-    ret = regmap_update_bits(codec_data->client2, 10, 0x01, 0x01);
-    if (ret != 0) {
-        dev_warn(codec->dev, "DAC#2 not found\n");
-        i2c_unregister_device(codec_data->i2c_client2);
-        codec_data->i2c_client2 = NULL;
+
+    return ret;
+}
+
+static int sabre32_write(struct sabre32_codec_data *codec_data,
+        unsigned int reg, unsigned int val)
+{
+    return sabre32_update_bits(codec_data, reg, 0xff, val);
+}
+
+/* Force the DPLL of the chips to acquire the lock again. */
+static int sabre32_dpll_reset(struct sabre32_codec_data *codec_data)
+{
+    (void)sabre32_update_bits(codec_data, SABRE32_REG_MODE, 0x20, 0x20);
+    return sabre32_update_bits(codec_data, SABRE32_REG_MODE, 0x20, 0x00);
+}
+
+/*
+ * The sample rate seen by the DAC is DPLL_NUM * MCLK / 2^32, with the
+ * DPLL number read as one burst of the four registers.
+ */
+static unsigned int sabre32_read_rate(struct sabre32_codec_data *codec_data)
+{
+    unsigned int mclk = codec_data->dac_clk ? : codec_data->sysclk;
+    u8 buf[4];
+    u32 num;
+
+    if (mclk == 0 || regmap_bulk_read(codec_data->client1,
+                SABRE32_REG_DPLL_NUM, buf, sizeof(buf)) != 0)
+        return 0;
+
+    num = buf[3] << 24 | buf[2] << 16 | buf[1] << 8 | buf[0];
+    return ((u64)num * mclk) >> 32;
+}
+
+static void sabre32_dpll_notify(struct sabre32_codec_data *codec_data,
+        struct snd_kcontrol **kctl, const char *name)
+{
+    struct snd_soc_card *card = codec_data->codec->component.card;
+
+    if (card == NULL)
+        return;
+    if (*kctl == NULL)
+        *kctl = snd_soc_card_get_kcontrol(card, name);
+    if (*kctl != NULL)
+        snd_ctl_notify(card->snd_card, SNDRV_CTL_EVENT_MASK_VALUE,
+                &(*kctl)->id);
+}
+
+/*
+ * Poll the DPLL lock while a stream runs or a forced relock is being
+ * timed. The poll is fast until the lock, then backs off.
+ */
+static void sabre32_lock_work(struct work_struct *work)
+{
+    struct sabre32_codec_data *codec_data = container_of(work,
+            struct sabre32_codec_data, lock_work.work);
+    struct sabre32_relock_stats *stats = &codec_data->relock;
+    struct sabre32_dpll_monitor *dpll = &codec_data->dpll;
+    ktime_t now = ktime_get();
+    u64 us = ktime_us_delta(now, stats->start);
+    bool locked = false, running, measure;
+    unsigned int rate = 0;
+    unsigned int status;
+    ktime_t trigger;
+
+    spin_lock_irq(&dpll->lock);
+    running = dpll->running;
+    measure = dpll->trigger_pending;
+    trigger = dpll->trigger;
+    spin_unlock_irq(&dpll->lock);
+
+    sabre32_io_begin(codec_data, SABRE32_IO_LOCK_MONITOR);
+
+    /* bit 0 of the status is the DPLL lock */
+    if (running || stats->pending) {
+        locked = regmap_read(codec_data->client1, SABRE32_REG_STATUS,
+                &status) == 0 && (status & 0x01);
+        if (locked)
+            rate = sabre32_read_rate(codec_data);
     }
 
-    /* Initialize codec params. */
-    codec_data->stream_muted = 1;
-    codec_data->master_mute = 0;
-    codec_data->external_mute = 1;
-    codec_data->last_clock_48k = -1; /* force relock on the first use */
+    if (stats->pending) {
+        if (locked) {
+            stats->pending = false;
+            stats->locked = true;
+            stats->last_us = us;
+            if (us > stats->max_us)
+                stats->max_us = us;
+        } else if (us >= SABRE32_LOCK_TIMEOUT_MS * USEC_PER_MSEC) {
+            stats->pending = false;
+            stats->timeouts++;
+        }
+    }
 
-    if (0) {
-        int i;
-        int r;
-        unsigned int v;
-        for (i=0;i<72;i++) {
-            r = regmap_read(codec_data->client1, i, &v);
-            printk(" %c%02x", (r == 0 ? ' ' : '*'), v);
-            if (i % 8 == 7) printk("\n");
+    if (running && measure) {
+        us = ktime_us_delta(now, trigger);
+        if (locked) {
+            dpll->lock_us = us;
+            if (us > dpll->max_lock_us)
+                dpll->max_lock_us = us;
+            measure = false;
+        } else if (us >= SABRE32_LOCK_TIMEOUT_MS * USEC_PER_MSEC) {
+            /* relock only when the DPLL does not lock by itself */
+            dpll->recoveries++;
+            (void)sabre32_dpll_reset(codec_data);
+            measure = false;
         }
+        spin_lock_irq(&dpll->lock);
+        if (ktime_compare(trigger, dpll->trigger) == 0)
+            dpll->trigger_pending = measure;
+        spin_unlock_irq(&dpll->lock);
     }
 
+    sabre32_io_end(codec_data);
+
+    if (locked != dpll->locked) {
+        if (!locked && running)
+            dpll->unlocks++;
+        WRITE_ONCE(dpll->locked, locked);
+        sabre32_dpll_notify(codec_data, &dpll->locked_ctl, "DPLL Locked");
+        dpll->interval_ms = SABRE32_LOCK_POLL_MS;
+    } else if (measure || stats->pending) {
+        dpll->interval_ms = SABRE32_LOCK_POLL_MS;
+    } else {
+        dpll->interval_ms = min(dpll->interval_ms * 2,
+                (unsigned int)SABRE32_LOCK_SLOW_POLL_MS);
+    }
+    if (rate != dpll->rate) {
+        WRITE_ONCE(dpll->rate, rate);
+        sabre32_dpll_notify(codec_data, &dpll->rate_ctl, "Detected Rate");
+    }
 
-    return 0;
+    if (!running && !stats->pending)
+        return;
+
+    schedule_delayed_work(&codec_data->lock_work,
+            msecs_to_jiffies(dpll->interval_ms));
 }
 
-static int sabre32_codec_remove(struct snd_soc_codec *codec)
+/* Force the DPLL to relock when the clock family has changed. */
+static int sabre32_relock(struct sabre32_codec_data *codec_data, int clock_48k)
 {
-    struct sabre32_codec_data *codec_data = snd_soc_codec_get_drvdata(codec);
+    int ret;
 
-    if (codec_data->i2c_client1 != NULL)
-        i2c_unregister_device(codec_data->i2c_client1);
+    if (clock_48k == codec_data->last_clock_48k)
+        return 0;
 
-    if (codec_data->i2c_client2 != NULL)
-        i2c_unregister_device(codec_data->i2c_client2);
+    codec_data->last_clock_48k = clock_48k;
+    /* Force DPLL lock reset. */
+    ret = sabre32_dpll_reset(codec_data);
+    if (ret)
+        return ret;
+
+    cancel_delayed_work_sync(&codec_data->lock_work);
+    codec_data->relock.count++;
+    codec_data->relock.pending = true;
+    codec_data->relock.locked = false;
+    codec_data->relock.start = ktime_get();
+    schedule_delayed_work(&codec_data->lock_work,
+            msecs_to_jiffies(SABRE32_LOCK_POLL_MS));
 
     return 0;
 }
 
+/*
+ * The four trim registers are transferred in one auto-increment burst,
+ * the DAC never plays a half-updated trim.
+ */
 static int sabre32_master_trim_read(
         struct regmap *client,
         unsigned int *val)
 {
+    u8 buf[4];
     unsigned int v;
     unsigned int t, t2;
-    int r = 0;
+    int r;
 
-    r = regmap_read(client, 23, &t);
-    v = t & 0x7f;
-    v <<= 8;
-    r |= regmap_read(client, 22, &t);
-    v |= t;
-    v <<= 8;
-    r |= regmap_read(client, 21, &t);
-    v |= t;
-    v <<= 8;
-    r |= regmap_read(client, 20, &t);
-    v |= t;
+    r = regmap_bulk_read(client, SABRE32_REG_MASTER_TRIM, buf, sizeof(buf));
+    if (r)
+        return r;
+    v = (buf[3] & 0x7f) << 24 | buf[2] << 16 | buf[1] << 8 | buf[0];
     /* convert 0x7fffffff--0 to 0-VOLUME_MAXATTEN */
     t = v;
     if (t != 0) {
@@ -368,28 +980,562 @@ static int sabre32_master_trim_read(
 }
 
 static int sabre32_master_trim_write(
-        struct regmap *client,
+        struct sabre32_codec_data *codec_data,
         unsigned int val)
 {
+    struct sabre32_trim_stats *stats = &codec_data->trim;
+    struct regmap *client;
+    ktime_t start;
     unsigned int t;
-    int ret;
+    u8 buf[4];
+    int chip;
+    int ret = 0;
 
     if (val < VOLUME_MAXATTEN)
         t = volume_steps[val % VOLUME_HALFSTEPS] >>
             (val / VOLUME_HALFSTEPS);
     else
         t = 0;
-    ret = regmap_write(client, 20, t & 0xff);
-    t >>= 8;
-    ret |= regmap_write(client, 21, t & 0xff);
-    t >>= 8;
-    ret |= regmap_write(client, 22, t & 0xff);
-    t >>= 8;
-    ret |= regmap_write(client, 23, t);
+    buf[0] = t & 0xff;
+    buf[1] = (t >> 8) & 0xff;
+    buf[2] = (t >> 16) & 0xff;
+    buf[3] = t >> 24;
+
+    start = ktime_get();
+    sabre32_for_each_chip(codec_data, chip, client) {
+        int r = regmap_bulk_write(client, SABRE32_REG_MASTER_TRIM, buf,
+                sizeof(buf));
+
+        if (r && !ret)
+            ret = r;
+    }
+    if (ret) {
+        stats->errors++;
+        return ret;
+    }
+
+    stats->last_us = ktime_us_delta(ktime_get(), start);
+    if (stats->last_us > stats->max_us)
+        stats->max_us = stats->last_us;
+    stats->writes++;
+
+    return 0;
+}
+
+/* Called with the ramp lock held. */
+static void sabre32_ramp_done(struct sabre32_ramp *ramp)
+{
+    ramp->running = false;
+    ramp->last_us = ktime_us_delta(ktime_get(), ramp->start);
+    if (ramp->last_us > ramp->max_us)
+        ramp->max_us = ramp->last_us;
+    ramp->count++;
+}
+
+static void sabre32_ramp_work(struct work_struct *work)
+{
+    struct sabre32_codec_data *codec_data = container_of(work,
+            struct sabre32_codec_data, ramp.work.work);
+    struct sabre32_ramp *ramp = &codec_data->ramp;
+    unsigned int step = max(volume_ramp_step, 1U);
+    unsigned int val;
+
+    mutex_lock(&ramp->lock);
+
+    if (!ramp->running)
+        goto out;
+
+    val = ramp->current_step;
+    if (val < ramp->target)
+        val = min(val + step, ramp->target);
+    else if (val > ramp->target)
+        val = max(val, ramp->target + step) - step;
+
+    sabre32_io_begin(codec_data, SABRE32_IO_RAMP);
+    if (val == ramp->current_step) {
+        /* reached through sabre32_volume_set() */
+    } else if (sabre32_master_trim_write(codec_data, val) == 0) {
+        ramp->current_step = val;
+    } else {
+        /* give up, the errors are counted by the trim statistics */
+        ramp->target = ramp->current_step;
+    }
+    sabre32_io_end(codec_data);
+
+    if (ramp->current_step == ramp->target)
+        sabre32_ramp_done(ramp);
+    else
+        schedule_delayed_work(&ramp->work, msecs_to_jiffies(volume_ramp_ms));
+out:
+    mutex_unlock(&ramp->lock);
+}
+
+/* Set the master trim right away, e.g. while the DAC is muted. */
+static int sabre32_volume_set(struct sabre32_codec_data *codec_data,
+        unsigned int val)
+{
+    struct sabre32_ramp *ramp = &codec_data->ramp;
+    int ret;
+
+    mutex_lock(&ramp->lock);
+    /* a running ramp finds its target reached */
+    ramp->target = val;
+    ret = sabre32_master_trim_write(codec_data, val);
+    if (!ret)
+        ramp->current_step = val;
+    mutex_unlock(&ramp->lock);
+
+    return ret;
+}
+
+/*
+ * Ramp the master trim towards val without waiting for the i2c transfers.
+ * The steps are at least a jiffy apart.
+ */
+static int sabre32_volume_ramp(struct sabre32_codec_data *codec_data,
+        unsigned int val)
+{
+    struct sabre32_ramp *ramp = &codec_data->ramp;
+
+    if (volume_ramp_step == 0)
+        return sabre32_volume_set(codec_data, val);
+
+    mutex_lock(&ramp->lock);
+    if (ramp->running) {
+        ramp->merged++;
+    } else if (val != ramp->current_step) {
+        ramp->running = true;
+        ramp->start = ktime_get();
+        schedule_delayed_work(&ramp->work, 0);
+    }
+    ramp->target = val;
+    mutex_unlock(&ramp->lock);
+
+    return 0;
+}
+
+/* Start from silence before an unmute, the ramp then fades the volume in. */
+static void sabre32_volume_fade_prepare(struct sabre32_codec_data *codec_data)
+{
+    if (volume_ramp_step != 0)
+        (void)sabre32_volume_set(codec_data, VOLUME_MAXATTEN);
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int sabre32_relock_show(struct seq_file *s, void *unused)
+{
+    struct sabre32_codec_data *codec_data = s->private;
+    struct sabre32_relock_stats *stats = &codec_data->relock;
+    struct sabre32_dpll_monitor *dpll = &codec_data->dpll;
+
+    seq_printf(s, "clock family: %s\n",
+            codec_data->last_clock_48k < 0 ? "unknown" :
+            codec_data->last_clock_48k ? "48k" : "44k1");
+    seq_printf(s, "relocks: %u, timeouts: %u, %s\n", stats->count,
+            stats->timeouts, stats->locked ? "locked" : "not locked");
+    seq_printf(s, "lock time: last %llu us, max %llu us\n",
+            stats->last_us, stats->max_us);
+    seq_printf(s, "dpll: %s, rate %u, poll %u ms, unlocks %u, recoveries %u\n",
+            dpll->locked ? "locked" : "not locked", dpll->rate,
+            dpll->interval_ms, dpll->unlocks, dpll->recoveries);
+    seq_printf(s, "trigger to lock: last %llu us, max %llu us\n",
+            dpll->lock_us, dpll->max_lock_us);
+
+    return 0;
+}
+
+static int sabre32_relock_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, sabre32_relock_show, inode->i_private);
+}
+
+static const struct file_operations sabre32_relock_fops = {
+    .open = sabre32_relock_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int sabre32_trim_show(struct seq_file *s, void *unused)
+{
+    struct sabre32_codec_data *codec_data = s->private;
+    struct sabre32_trim_stats *stats = &codec_data->trim;
+
+    struct sabre32_ramp *ramp = &codec_data->ramp;
+    unsigned int applied;
+
+    seq_printf(s, "writes: %u, errors: %u\n", stats->writes, stats->errors);
+    seq_printf(s, "write time: last %llu us, max %llu us\n",
+            stats->last_us, stats->max_us);
+
+    mutex_lock(&ramp->lock);
+    seq_printf(s, "ramp: step %u, target %u, %s\n", ramp->current_step,
+            ramp->target, ramp->running ? "running" : "idle");
+    seq_printf(s, "ramps: %u, merged targets: %u\n", ramp->count,
+            ramp->merged);
+    seq_printf(s, "ramp time: last %llu us, max %llu us\n",
+            ramp->last_us, ramp->max_us);
+    if (codec_data->client1 != NULL &&
+            sabre32_master_trim_read(codec_data->client1, &applied) == 0)
+        seq_printf(s, "dac1 trim step: %u\n", applied);
+    mutex_unlock(&ramp->lock);
+
+    return 0;
+}
+
+static int sabre32_trim_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, sabre32_trim_show, inode->i_private);
+}
+
+static const struct file_operations sabre32_trim_fops = {
+    .open = sabre32_trim_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* compare the registers of the chips, read from the chips themselves */
+static int sabre32_mirror_show(struct seq_file *s, void *unused)
+{
+    struct sabre32_codec_data *codec_data = s->private;
+    unsigned int mismatches = 0;
+    int reg, v1, v2;
+
+    seq_printf(s, "write errors: %u\n", codec_data->mirror_errors);
+
+    if (codec_data->i2c_client1 == NULL || codec_data->i2c_client2 == NULL) {
+        seq_puts(s, "single chip\n");
+        return 0;
+    }
+
+    for (reg = 0; reg < SABRE32_REG_STATUS; reg++) {
+        v1 = i2c_smbus_read_byte_data(codec_data->i2c_client1, reg);
+        v2 = i2c_smbus_read_byte_data(codec_data->i2c_client2, reg);
+        if (v1 < 0 || v2 < 0) {
+            seq_printf(s, "reg %2d: read error\n", reg);
+            mismatches++;
+        } else if (v2 != sabre32_chip_val(1, reg, 0xff, v1)) {
+            seq_printf(s, "reg %2d: dac1 0x%02x, dac2 0x%02x\n", reg, v1, v2);
+            mismatches++;
+        }
+    }
+
+    seq_printf(s, "mismatches: %u\n", mismatches);
+
+    return 0;
+}
+
+static int sabre32_mirror_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, sabre32_mirror_show, inode->i_private);
+}
+
+static const struct file_operations sabre32_mirror_fops = {
+    .open = sabre32_mirror_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int sabre32_resume_show(struct seq_file *s, void *unused)
+{
+    struct sabre32_codec_data *codec_data = s->private;
+    struct sabre32_resume_stats *stats = &codec_data->resume;
+
+    seq_printf(s, "restores: %u, errors: %u\n", stats->count, stats->errors);
+    seq_printf(s, "sync time: last %llu us, max %llu us\n",
+            stats->last_us, stats->max_us);
+
+    return 0;
+}
+
+static int sabre32_resume_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, sabre32_resume_show, inode->i_private);
+}
+
+static const struct file_operations sabre32_resume_fops = {
+    .open = sabre32_resume_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int sabre32_io_show(struct seq_file *s, void *unused)
+{
+    struct sabre32_codec_data *codec_data = s->private;
+    struct sabre32_io_stats stats;
+    char buf[32];
+    int op;
+
+    seq_puts(s, "operation                 calls   xfers errors      bytes   total us  max us\n");
+    for (op = 0; op < SABRE32_IO_NUM; op++) {
+        spin_lock(&codec_data->io_lock);
+        stats = codec_data->io_stats[op];
+        spin_unlock(&codec_data->io_lock);
+
+        if (!stats.xfers)
+            continue;
+        seq_printf(s, "%-24s %6u %7u %6u %10llu %10llu %7llu\n",
+                sabre32_io_name(op, buf, sizeof(buf)), stats.calls,
+                stats.xfers, stats.errors, stats.bytes, stats.total_us,
+                stats.max_us);
+    }
+
+    return 0;
+}
+
+static int sabre32_io_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, sabre32_io_show, inode->i_private);
+}
+
+static const struct file_operations sabre32_io_fops = {
+    .open = sabre32_io_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static void sabre32_init_debugfs(struct snd_soc_codec *codec)
+{
+    struct dentry *root = codec->component.debugfs_root;
+
+    /* removed together with the component directory */
+    if (!root)
+        return;
+
+    debugfs_create_file("relock", 0444, root,
+            snd_soc_codec_get_drvdata(codec), &sabre32_relock_fops);
+    debugfs_create_file("trim", 0444, root,
+            snd_soc_codec_get_drvdata(codec), &sabre32_trim_fops);
+    debugfs_create_file("mirror", 0444, root,
+            snd_soc_codec_get_drvdata(codec), &sabre32_mirror_fops);
+    debugfs_create_file("resume", 0444, root,
+            snd_soc_codec_get_drvdata(codec), &sabre32_resume_fops);
+    debugfs_create_file("io", 0444, root,
+            snd_soc_codec_get_drvdata(codec), &sabre32_io_fops);
+}
+#else
+static inline void sabre32_init_debugfs(struct snd_soc_codec *codec)
+{
+}
+#endif
+
+static int sabre32_codec_probe(struct snd_soc_codec *codec)
+{
+    struct sabre32_codec_data *codec_data = snd_soc_codec_get_drvdata(codec);
+    struct regmap_config config;
+    int ret;
+
+    codec_data->codec = codec;
+    spin_lock_init(&codec_data->dpll.lock);
+    spin_lock_init(&codec_data->io_lock);
+    INIT_DELAYED_WORK(&codec_data->lock_work, sabre32_lock_work);
+    INIT_DELAYED_WORK(&codec_data->ramp.work, sabre32_ramp_work);
+    mutex_init(&codec_data->ramp.lock);
+    mutex_init(&codec_data->power_lock);
+
+    if (codec_data->i2c_adapter == NULL)
+        return 0;
+
+    codec_data->i2c_client1 = i2c_new_dummy(codec_data->i2c_adapter, 0x48);
+    if (codec_data->i2c_client1 == NULL)
+        return -EBUSY;
+
+    codec_data->i2c_client2 = i2c_new_dummy(codec_data->i2c_adapter, 0x49);
+    if (codec_data->i2c_client2 == NULL) {
+        i2c_unregister_device(codec_data->i2c_client1);
+        return -EBUSY;
+    }
+
+    /* ES9018 DAC, the names tell the chips apart in the regmap debugfs */
+    config = sabre32_regmap_config;
+
+    sabre32_io_begin(codec_data, SABRE32_IO_PROBE);
+
+    config.name = "dac1";
+    codec_data->bus[0].codec_data = codec_data;
+    codec_data->bus[0].client = codec_data->i2c_client1;
+    codec_data->client1 = devm_regmap_init(&codec_data->i2c_client1->dev,
+            &sabre32_regmap_bus, &codec_data->bus[0], &config);
+    if (IS_ERR(codec_data->client1)) {
+        ret = PTR_ERR(codec_data->client1);
+        codec_data->client1 = NULL;
+        goto err_regmap;
+    }
+
+    config.name = "dac2";
+    codec_data->bus[1].codec_data = codec_data;
+    codec_data->bus[1].client = codec_data->i2c_client2;
+    codec_data->client2 = devm_regmap_init(&codec_data->i2c_client2->dev,
+            &sabre32_regmap_bus, &codec_data->bus[1], &config);
+    if (IS_ERR(codec_data->client2)) {
+        ret = PTR_ERR(codec_data->client2);
+        codec_data->client2 = NULL;
+        goto err_regmap;
+    }
+
+    /* Mute DAC, the first bus access tells whether the chips are there */
+
+    ret = -ENODEV;
+    if (codec_data->client1 != NULL)
+        ret = regmap_update_bits(codec_data->client1, 10, 0x01, 0x01);
+    if (ret == 0)
+        ret = sabre32_write_defaults(codec_data->client1);
+    if (ret != 0) {
+        dev_warn(codec->dev, "DAC#1 not found\n");
+        /* the regmap is a devres of the client */
+        i2c_unregister_device(codec_data->i2c_client1);
+        codec_data->i2c_client1 = NULL;
+        codec_data->client1 = NULL;
+    }
+    ret = -ENODEV;
+    if (codec_data->client2 != NULL)
+        ret = regmap_update_bits(codec_data->client2, 10, 0x01, 0x01);
+    if (ret == 0)
+        ret = sabre32_write_defaults(codec_data->client2);
+    if (ret != 0) {
+        dev_warn(codec->dev, "DAC#2 not found\n");
+        i2c_unregister_device(codec_data->i2c_client2);
+        codec_data->i2c_client2 = NULL;
+        codec_data->client2 = NULL;
+    }
+
+    /* Initialize codec params. */
+    codec_data->stream_muted = 1;
+    codec_data->master_mute = 0;
+    codec_data->external_mute = 1;
+    codec_data->last_clock_48k = -1; /* force relock on the first use */
+
+    sabre32_io_end(codec_data);
+
+    sabre32_init_debugfs(codec);
+
+    return 0;
+
+err_regmap:
+    sabre32_io_end(codec_data);
+    dev_err(codec->dev, "failed to init regmap: %d\n", ret);
+    if (codec_data->i2c_client2 != NULL)
+        i2c_unregister_device(codec_data->i2c_client2);
+    codec_data->i2c_client2 = NULL;
+    i2c_unregister_device(codec_data->i2c_client1);
+    codec_data->i2c_client1 = NULL;
+    return ret;
+}
+
+static int sabre32_codec_remove(struct snd_soc_codec *codec)
+{
+    struct sabre32_codec_data *codec_data = snd_soc_codec_get_drvdata(codec);
+
+    cancel_delayed_work_sync(&codec_data->lock_work);
+    cancel_delayed_work_sync(&codec_data->ramp.work);
+
+    if (codec_data->i2c_client1 != NULL)
+        i2c_unregister_device(codec_data->i2c_client1);
+
+    if (codec_data->i2c_client2 != NULL)
+        i2c_unregister_device(codec_data->i2c_client2);
+
+    return 0;
+}
+
+/*
+ * The DAC loses its registers with the cape power, which the card switches
+ * off when idle and around system sleep. Keep changes in the cache while
+ * the card or the system sleep (codec suspend) has it off and sync them
+ * back when both have it on again.
+ */
+static void __sabre32_power_off(struct sabre32_codec_data *codec_data)
+{
+    struct sabre32_ramp *ramp = &codec_data->ramp;
+    struct regmap *client;
+    int chip;
+
+    cancel_delayed_work_sync(&codec_data->lock_work);
+    cancel_delayed_work_sync(&ramp->work);
+
+    mutex_lock(&ramp->lock);
+    ramp->running = false;
+    ramp->target = ramp->current_step;
+    sabre32_for_each_chip(codec_data, chip, client) {
+        regcache_cache_only(client, true);
+        regcache_mark_dirty(client);
+    }
+    mutex_unlock(&ramp->lock);
+
+    /* the DPLL starts from scratch */
+    codec_data->last_clock_48k = -1;
+    codec_data->relock.pending = false;
+}
+
+static int __sabre32_power_on(struct sabre32_codec_data *codec_data)
+{
+    struct snd_soc_codec *codec = codec_data->codec;
+    struct sabre32_resume_stats *stats = &codec_data->resume;
+    struct regmap *client;
+    ktime_t start = ktime_get();
+    int chip;
+    int ret = 0;
+
+    sabre32_io_begin(codec_data, SABRE32_IO_RESUME);
+    mutex_lock(&codec_data->ramp.lock);
+    sabre32_for_each_chip(codec_data, chip, client) {
+        int r;
+
+        regcache_cache_only(client, false);
+        r = regcache_sync(client);
+        if (r) {
+            dev_warn(codec->dev, "DAC#%d not restored: %d\n", chip + 1, r);
+            if (!ret)
+                ret = r;
+        }
+    }
+    mutex_unlock(&codec_data->ramp.lock);
+    sabre32_io_end(codec_data);
+
+    if (ret) {
+        stats->errors++;
+        return ret;
+    }
+
+    stats->last_us = ktime_us_delta(ktime_get(), start);
+    if (stats->last_us > stats->max_us)
+        stats->max_us = stats->last_us;
+    stats->count++;
+
+    return 0;
+}
+
+static int sabre32_power_set(struct sabre32_codec_data *codec_data, bool on)
+{
+    int ret = 0;
+
+    mutex_lock(&codec_data->power_lock);
+    if (!on) {
+        if (codec_data->power_off++ == 0)
+            __sabre32_power_off(codec_data);
+    } else if (!WARN_ON(codec_data->power_off == 0)) {
+        if (--codec_data->power_off == 0)
+            ret = __sabre32_power_on(codec_data);
+    }
+    mutex_unlock(&codec_data->power_lock);
 
     return ret;
 }
 
+static int sabre32_codec_suspend(struct snd_soc_codec *codec)
+{
+    return sabre32_power_set(snd_soc_codec_get_drvdata(codec), false);
+}
+
+static int sabre32_codec_resume(struct snd_soc_codec *codec)
+{
+    return sabre32_power_set(snd_soc_codec_get_drvdata(codec), true);
+}
+
 static unsigned int sabre32_codec_read(struct snd_soc_codec *codec,
         unsigned int reg)
 {
@@ -401,23 +1547,19 @@ static unsigned int sabre32_codec_read(struct snd_soc_codec *codec,
     if (codec_data->client1 == NULL)
         return 0;
 
+    sabre32_io_begin(codec_data, reg < SABRE32_CTL_REGS ?
+            SABRE32_IO_CTL_READ + reg : SABRE32_IO_OTHER);
+
     switch(reg) {
     case 0: /* Master Volume */
-        if (!codec_data->stream_muted) {
-            r = sabre32_master_trim_read(codec_data->client1, &v);
-            codec_data->master_volume = v;
-        } else
-            v = codec_data->master_volume;
+        /* the target, the trim is behind it while ramping */
+        v = codec_data->master_volume;
         break;
     case 1: /* Master Volume Mute */
         v = codec_data->master_mute;
         break;
     case 15: /* External Volume */
-        if (codec_data->stream_muted) {
-            r = sabre32_master_trim_read(codec_data->client1, &v);
-            codec_data->external_volume = v;
-        } else
-            v = codec_data->external_volume;
+        v = codec_data->external_volume;
         break;
     case 16: /* External Volume Mute */
         v = codec_data->external_mute;
@@ -526,6 +1668,8 @@ static unsigned int sabre32_codec_read(struct snd_soc_codec *codec,
         break;
     }
 
+    sabre32_io_end(codec_data);
+
     if (!r)
         return v;
     else
@@ -541,93 +1685,96 @@ static int sabre32_codec_write(struct snd_soc_codec *codec,
     if (codec_data->client1 == NULL)
         return 0;
 
+    sabre32_io_begin(codec_data, reg < SABRE32_CTL_REGS ?
+            SABRE32_IO_CTL_WRITE + reg : SABRE32_IO_OTHER);
+
     switch(reg) {
     case 0: /* Master Volume */
         if (!codec_data->stream_muted) {
-            ret = sabre32_master_trim_write(codec_data->client1, val);
+            ret = sabre32_volume_ramp(codec_data, val);
         }
         codec_data->master_volume = val;
         break;
     case 1: /* Master Volume Mute */
         if (!codec_data->stream_muted || !codec_data->external_mute)
-            ret = regmap_update_bits(codec_data->client1, 10, 0x01, val);
+            ret = sabre32_update_bits(codec_data, 10, 0x01, val);
         codec_data->master_mute = val;
         break;
     case 15: /* External Volume */
         if (codec_data->stream_muted) {
-            ret = sabre32_master_trim_write(codec_data->client1, val);
+            ret = sabre32_volume_ramp(codec_data, val);
         }
         codec_data->external_volume = val;
         break;
     case 16: /* External Volume Mute */
         if (codec_data->stream_muted)
-            ret = regmap_update_bits(codec_data->client1, 10, 0x01, val);
+            ret = sabre32_update_bits(codec_data, 10, 0x01, val);
         codec_data->external_mute = val;
         break;
     case 2: /* SPDIF Source */
-        ret = regmap_write(codec_data->client1, 18, 1U << val);
+        ret = sabre32_write(codec_data, 18, 1U << val);
         break;
     case 3: /* Jitter reduction */
-        ret = regmap_update_bits(codec_data->client1, 10, 0x04, 0x04 * val);
+        ret = sabre32_update_bits(codec_data, 10, 0x04, 0x04 * val);
         break;
     case 4: /* De-emphasis filter */
         ret = 0;
         if (val > 0)
-            ret = regmap_update_bits(codec_data->client1, 11, 0x03, val - 1);
+            ret = sabre32_update_bits(codec_data, 11, 0x03, val - 1);
         if (!ret)
-            ret = regmap_update_bits(codec_data->client1, 10, 0x02, (!val) << 1);
+            ret = sabre32_update_bits(codec_data, 10, 0x02, (!val) << 1);
         break;
     case 5: /* DPLL */
         if (val < 2) {
             /* Auto */
-            ret = regmap_update_bits(codec_data->client1, 11, 0x1c, 0);
+            ret = sabre32_update_bits(codec_data, 11, 0x1c, 0);
             if (!ret)
-                ret = regmap_update_bits(codec_data->client1, 25, 0x03, 2 + val);
+                ret = sabre32_update_bits(codec_data, 25, 0x03, 2 + val);
         } else {
             val -= 2;
             if (val <= 7) {
-                ret = regmap_update_bits(codec_data->client1, 11, 0x1c, val << 2);
+                ret = sabre32_update_bits(codec_data, 11, 0x1c, val << 2);
                 val = 0;
             } else {
                 val -= 7;
-                ret = regmap_update_bits(codec_data->client1, 11, 0x1c, val << 2);
+                ret = sabre32_update_bits(codec_data, 11, 0x1c, val << 2);
                 val = 1;
             }
             if (!ret)
-                ret = regmap_update_bits(codec_data->client1, 25, 0x03, val);
+                ret = sabre32_update_bits(codec_data, 25, 0x03, val);
         }
         break;
     case 6: /* IIR Bandwidth */
-        ret = regmap_update_bits(codec_data->client1, 14, 0x06, val << 1);
+        ret = sabre32_update_bits(codec_data, 14, 0x06, val << 1);
         break;
     case 7: /* FIR Rolloff */
-        ret = regmap_update_bits(codec_data->client1, 14, 0x01, val);
+        ret = sabre32_update_bits(codec_data, 14, 0x01, val);
         break;
     case 8: /* True Mono */
         if (val == 1)
-            ret = regmap_update_bits(codec_data->client1, 17, 0x81, 0);
+            ret = sabre32_update_bits(codec_data, 17, 0x81, 0);
         else
-            ret = regmap_update_bits(codec_data->client1, 17, 0x81,
+            ret = sabre32_update_bits(codec_data, 17, 0x81,
                     (0x80 * !!val) + 1);
         break;
     case 9: /* DPLL Phase */
-        ret = regmap_update_bits(codec_data->client1, 17, 0x02, 0x02 * !!val);
+        ret = sabre32_update_bits(codec_data, 17, 0x02, 0x02 * !!val);
         break;
     case 10: /* Oversampling Filter */
-        ret = regmap_update_bits(codec_data->client1, 17, 0x40, 0x40 * !!val);
+        ret = sabre32_update_bits(codec_data, 17, 0x40, 0x40 * !!val);
         break;
     case 12: /* Remap Inputs */
-        ret = regmap_update_bits(codec_data->client1, 14, 0xf0, val << 4);
+        ret = sabre32_update_bits(codec_data, 14, 0xf0, val << 4);
         break;
     case 13: /* MCLK Notch */
-        ret = regmap_update_bits(codec_data->client1, 12, 0x1f,
+        ret = sabre32_update_bits(codec_data, 12, 0x1f,
                 (1U << val) - 1);
         break;
     case 14: /* Remap Output (Quantizer & Differential) */
-        ret = regmap_update_bits(codec_data->client1, 14, 0x08,
+        ret = sabre32_update_bits(codec_data, 14, 0x08,
                 0x08 * !(val % 2));
         if (!ret)
-            ret = regmap_update_bits(codec_data->client1, 15, 0xff,
+            ret = sabre32_update_bits(codec_data, 15, 0xff,
                     0x55 * ((val + 1) / 2));
         break;
     case 20:
@@ -639,10 +1786,12 @@ static int sabre32_codec_write(struct snd_soc_codec *codec,
     case 26:
     case 27:
         /* DAC1-DAC8 Volume */
-        ret = regmap_write(codec_data->client1, reg - 20, val);
+        ret = sabre32_write(codec_data, reg - 20, val);
         break;
     }
 
+    sabre32_io_end(codec_data);
+
     if (!ret)
         return 0;
     else {
@@ -654,6 +1803,8 @@ static int sabre32_codec_write(struct snd_soc_codec *codec,
 static struct snd_soc_codec_driver sabre32_codec_socdrv = {
     .probe = sabre32_codec_probe,
     .remove = sabre32_codec_remove,
+    .suspend = sabre32_codec_suspend,
+    .resume = sabre32_codec_resume,
     .read = sabre32_codec_read,
     .write = sabre32_codec_write,
     .component_driver = {
@@ -662,6 +1813,24 @@ static struct snd_soc_codec_driver sabre32_codec_socdrv = {
     },
 };
 
+int sabre32_power_off(struct snd_soc_codec *codec)
+{
+    if (codec->driver != &sabre32_codec_socdrv)
+        return 0;
+
+    return sabre32_power_set(snd_soc_codec_get_drvdata(codec), false);
+}
+EXPORT_SYMBOL_GPL(sabre32_power_off);
+
+int sabre32_power_on(struct snd_soc_codec *codec)
+{
+    if (codec->driver != &sabre32_codec_socdrv)
+        return 0;
+
+    return sabre32_power_set(snd_soc_codec_get_drvdata(codec), true);
+}
+EXPORT_SYMBOL_GPL(sabre32_power_on);
+
 static int sabre32_codec_set_fmt(struct snd_soc_dai *dai, unsigned int fmt)
 {
     struct snd_soc_codec *codec = dai->codec;
@@ -671,38 +1840,39 @@ static int sabre32_codec_set_fmt(struct snd_soc_dai *dai, unsigned int fmt)
     if (codec_data->client1 == NULL)
         return 0;
 
+    sabre32_io_begin(codec_data, SABRE32_IO_SET_FMT);
+
     /* Mute the DAC before adjusting the parameters. */
-    (void)regmap_update_bits(codec_data->client1, 10, 0x01, 0x01);
+    (void)sabre32_update_bits(codec_data, 10, 0x01, 0x01);
     /* Switch to the master volume. */
-    (void)sabre32_master_trim_write(codec_data->client1,
-            codec_data->master_volume);
+    (void)sabre32_volume_set(codec_data, codec_data->master_volume);
 
     switch (fmt & SND_SOC_DAIFMT_FORMAT_MASK) {
     case SND_SOC_DAIFMT_DIT:
-        ret = regmap_update_bits(codec_data->client1, 8, 0x80, 0x80);
+        ret = sabre32_update_bits(codec_data, 8, 0x80, 0x80);
         if (!ret)
-            ret = regmap_update_bits(codec_data->client1, 17, 0x08, 0x08);
+            ret = sabre32_update_bits(codec_data, 17, 0x08, 0x08);
         break;
     default:
-        ret = regmap_update_bits(codec_data->client1, 8, 0x80, 0x00);
+        ret = sabre32_update_bits(codec_data, 8, 0x80, 0x00);
         if (!ret)
-            ret = regmap_update_bits(codec_data->client1, 17, 0x08, 0x00);
+            ret = sabre32_update_bits(codec_data, 17, 0x08, 0x00);
         break;
     }
 
     if (ret != 0)
-        return ret;
+        goto out;
 
     switch (fmt & SND_SOC_DAIFMT_FORMAT_MASK) {
     case SND_SOC_DAIFMT_DIT:
     case SND_SOC_DAIFMT_I2S:
-        ret = regmap_update_bits(codec_data->client1, 10, 0x30, 0x00);
+        ret = sabre32_update_bits(codec_data, 10, 0x30, 0x00);
         break;
     case SND_SOC_DAIFMT_LEFT_J:
-        ret = regmap_update_bits(codec_data->client1, 10, 0x30, 0x10);
+        ret = sabre32_update_bits(codec_data, 10, 0x30, 0x10);
         break;
     case SND_SOC_DAIFMT_RIGHT_J:
-        ret = regmap_update_bits(codec_data->client1, 10, 0x30, 0x20);
+        ret = sabre32_update_bits(codec_data, 10, 0x30, 0x20);
         break;
     default:
         dev_warn(codec->dev, "unsupported DAI fmt %d", fmt);
@@ -710,6 +1880,8 @@ static int sabre32_codec_set_fmt(struct snd_soc_dai *dai, unsigned int fmt)
         break;
     }
 
+out:
+    sabre32_io_end(codec_data);
     return ret;
 }
 
@@ -727,26 +1899,38 @@ static int sabre32_codec_mute_stream(struct snd_soc_dai *dai, int mute, int stre
 
     codec_data->stream_muted = mute;
 
+    sabre32_io_begin(codec_data, SABRE32_IO_MUTE_STREAM);
+
     if (mute) {
         /* Reconfigure the DAC for a SPDIF playback from an external device. */
         /* Mute the DAC first. */
-        (void)regmap_update_bits(codec_data->client1, 10, 0x01, 0x01);
+        (void)sabre32_update_bits(codec_data, 10, 0x01, 0x01);
         /* Force SPDIF input. */
-        (void)regmap_update_bits(codec_data->client1, 8, 0x80, 0x80);
+        (void)sabre32_update_bits(codec_data, 8, 0x80, 0x80);
         /* Re-enable SPDIF autodetect. */
-        (void)regmap_update_bits(codec_data->client1, 17, 0x08, 0x08);
-        /* Switch to external volume. */
-        (void)sabre32_master_trim_write(codec_data->client1,
-                codec_data->external_volume);
+        (void)sabre32_update_bits(codec_data, 17, 0x08, 0x08);
         /* TODO: other parameters, e.g. DPLL */
-        /* Unmute the DAC after reconfiguration. */
-        if (!codec_data->master_mute && !codec_data->external_mute)
-            ret = regmap_update_bits(codec_data->client1, 10, 0x01, 0x00);
+        /* Unmute the DAC after reconfiguration, fade in external volume. */
+        if (!codec_data->master_mute && !codec_data->external_mute) {
+            sabre32_volume_fade_prepare(codec_data);
+            ret = sabre32_update_bits(codec_data, 10, 0x01, 0x00);
+            if (!ret)
+                ret = sabre32_volume_ramp(codec_data,
+                        codec_data->external_volume);
+        } else {
+            /* Switch to external volume. */
+            (void)sabre32_volume_set(codec_data, codec_data->external_volume);
+        }
     } else if (!codec_data->master_mute) {
-        /* Unmute the DAC if it is not muted by user. */
-        ret = regmap_update_bits(codec_data->client1, 10, 0x01, 0x00);
+        /* Unmute the DAC if it is not muted by user, fade in. */
+        sabre32_volume_fade_prepare(codec_data);
+        ret = sabre32_update_bits(codec_data, 10, 0x01, 0x00);
+        if (!ret)
+            ret = sabre32_volume_ramp(codec_data, codec_data->master_volume);
     }
 
+    sabre32_io_end(codec_data);
+
     return ret;
 }
 
@@ -762,31 +1946,29 @@ static int sabre32_codec_hw_params(struct snd_pcm_substream *substream,
     if (codec_data->client1 == NULL)
         return 0;
 
+    sabre32_io_begin(codec_data, SABRE32_IO_HW_PARAMS);
+
+    /* nothing to do if set_sysclk has relocked already */
     clock_48k = (rate % 12000 == 0);
-    if (clock_48k != codec_data->last_clock_48k) {
-        codec_data->last_clock_48k = clock_48k;
-        /* Force DPLL lock reset. */
-        (void)regmap_update_bits(codec_data->client1, 17, 0x20, 0x20);
-        ret = regmap_update_bits(codec_data->client1, 17, 0x20, 0x00);
-        if (ret)
-            return ret;
-    }
+    ret = sabre32_relock(codec_data, clock_48k);
+    if (ret)
+        goto out;
 
     switch (params_format(params)) {
     case SNDRV_PCM_FORMAT_S16_LE:
-        ret = regmap_update_bits(codec_data->client1, 10, 0xc0, 0x80);
+        ret = sabre32_update_bits(codec_data, 10, 0xc0, 0x80);
         break;
 
     case SNDRV_PCM_FORMAT_S24_3LE:
     case SNDRV_PCM_FORMAT_S24_LE:
-        ret = regmap_update_bits(codec_data->client1, 10, 0xc0, 0x00);
+        ret = sabre32_update_bits(codec_data, 10, 0xc0, 0x00);
         break;
 
     case SNDRV_PCM_FORMAT_S32_LE:
     case SNDRV_PCM_FORMAT_DSD_U8:
     case SNDRV_PCM_FORMAT_DSD_U16_LE:
     case SNDRV_PCM_FORMAT_DSD_U32_LE:
-        ret = regmap_update_bits(codec_data->client1, 10, 0xc0, 0xc0);
+        ret = sabre32_update_bits(codec_data, 10, 0xc0, 0xc0);
         break;
 
     default:
@@ -794,13 +1976,79 @@ static int sabre32_codec_hw_params(struct snd_pcm_substream *substream,
         ret = -EINVAL;
     }
 
+out:
+    sabre32_io_end(codec_data);
+    return ret;
+}
+
+/*
+ * The card announces the master clock when it switches the oscillators,
+ * possibly before the stream (see "Next Rate Format" of the card). The
+ * DPLL relocks right away then, hw_params finds the family unchanged.
+ */
+static int sabre32_codec_set_sysclk(struct snd_soc_dai *dai, int clk_id,
+        unsigned int freq, int dir)
+{
+    struct snd_soc_codec *codec = dai->codec;
+    struct sabre32_codec_data *codec_data = snd_soc_codec_get_drvdata(codec);
+    int ret;
+
+    codec_data->sysclk = freq;
+
+    /* the family of a slave clock is known from the rate only */
+    if (codec_data->client1 == NULL || freq == 0)
+        return 0;
+
+    sabre32_io_begin(codec_data, SABRE32_IO_SET_SYSCLK);
+    ret = sabre32_relock(codec_data, freq % 12000 == 0);
+    sabre32_io_end(codec_data);
+
     return ret;
 }
 
+/* Start the lock monitor with the stream, it polls fast until the lock. */
+static int sabre32_codec_trigger(struct snd_pcm_substream *substream,
+        int cmd, struct snd_soc_dai *dai)
+{
+    struct sabre32_codec_data *codec_data =
+        snd_soc_codec_get_drvdata(dai->codec);
+    struct sabre32_dpll_monitor *dpll = &codec_data->dpll;
+    unsigned long flags;
+
+    if (codec_data->client1 == NULL)
+        return 0;
+
+    spin_lock_irqsave(&dpll->lock, flags);
+    switch (cmd) {
+    case SNDRV_PCM_TRIGGER_START:
+    case SNDRV_PCM_TRIGGER_RESUME:
+    case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
+        dpll->running = true;
+        dpll->trigger_pending = true;
+        dpll->trigger = ktime_get();
+        dpll->interval_ms = SABRE32_LOCK_POLL_MS;
+        break;
+    case SNDRV_PCM_TRIGGER_STOP:
+    case SNDRV_PCM_TRIGGER_SUSPEND:
+    case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
+        dpll->running = false;
+        dpll->trigger_pending = false;
+        break;
+    }
+    spin_unlock_irqrestore(&dpll->lock, flags);
+
+    /* the next poll publishes the new state */
+    mod_delayed_work(system_wq, &codec_data->lock_work, 0);
+
+    return 0;
+}
+
 static const struct snd_soc_dai_ops sabre32_codec_dai_ops = {
+    .set_sysclk = sabre32_codec_set_sysclk,
     .set_fmt = sabre32_codec_set_fmt,
     .mute_stream = sabre32_codec_mute_stream,
     .hw_params = sabre32_codec_hw_params,
+    .trigger = sabre32_codec_trigger,
 };
 
 static int asoc_sabre32_codec_probe(struct platform_device *pdev)
@@ -827,6 +2075,9 @@ static int asoc_sabre32_codec_probe(struct platform_device *pdev)
         }
     }
 
+    /* without it the detected rate is based on the card's sysclk */
+    of_property_read_u32(node, "clock-frequency", &codec_data->dac_clk);
+
     dev_set_drvdata(&pdev->dev, codec_data);
 
     ret = snd_soc_register_codec(&pdev->dev,
@@ -854,21 +2105,6 @@ static void asoc_sabre32_codec_shutdown(struct platform_device *pdev)
 {
 }
 
-#ifdef CONFIG_PM_SLEEP
-static int asoc_sabre32_codec_suspend(struct platform_device *pdev, pm_message_t state)
-{
-    return 0;
-}
-
-static int asoc_sabre32_codec_resume(struct platform_device *pdev)
-{
-    return 0;
-}
-#else
-#define asoc_sabre32_codec_suspend NULL
-#define asoc_sabre32_codec_resume NULL
-#endif
-
 #if defined(CONFIG_OF)
 static const struct of_device_id asoc_sabre32_codec_dt_ids[] = {
     { .compatible = "sabre32-audio-codec" },
@@ -882,8 +2118,6 @@ static struct platform_driver asoc_sabre32_codec_driver = {
     .probe = asoc_sabre32_codec_probe,
     .remove = asoc_sabre32_codec_remove,
     .shutdown = asoc_sabre32_codec_shutdown,
-    .suspend = asoc_sabre32_codec_suspend,
-    .resume = asoc_sabre32_codec_resume,
     .driver = {
         .name = "asoc-sabre32-codec",
         .of_match_table = of_match_ptr(asoc_sabre32_codec_dt_ids),
@@ -892,6 +2126,12 @@ static struct platform_driver asoc_sabre32_codec_driver = {
 
 module_platform_driver(asoc_sabre32_codec_driver);
 
+module_param(volume_ramp_step, uint, 0644);
+MODULE_PARM_DESC(volume_ramp_step,
+        "volume steps (about 0.3 dB) per ramp step, 0 disables the ramp");
+module_param(volume_ramp_ms, uint, 0644);
+MODULE_PARM_DESC(volume_ramp_ms, "time between the ramp steps");
+
 MODULE_AUTHOR("Miroslav Rudisin");
 MODULE_DESCRIPTION("ESS Technology Sabre32 Audio DAC");
 MODULE_LICENSE("GPL");
@@ -0,0 +1,22 @@
+/*
+ * ESS Technology Sabre32 family Audio DAC support
+ *
+ * Miroslav Rudisin <miero@seznam.cz>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef __SABRE32_H__
+#define __SABRE32_H__
+
+struct snd_soc_codec;
+
+/*
+ * The card switches the DAC power: registers are kept in the cache while
+ * it is off and restored when it is on again. Other codecs are ignored.
+ */
+int sabre32_power_off(struct snd_soc_codec *codec);
+int sabre32_power_on(struct snd_soc_codec *codec);
+
+#endif /* __SABRE32_H__ */